@@ -0,0 +1,98 @@
+#ifndef CIMPLE_BENCH_OVERHEAD_H
+#define CIMPLE_BENCH_OVERHEAD_H
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+// Hand-written C++ counterparts of the bench blocks in bench/overhead.cm, over the same data.
+namespace cimple::overhead {
+
+constexpr std::size_t length = 4096;
+
+inline std::vector<double> numbers(std::size_t n) {
+    std::vector<double> values;
+    values.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        values.push_back(i * 0.5);
+    return values;
+}
+
+inline const std::vector<double> x = numbers(length);
+inline const std::vector<double> y = numbers(length);
+
+inline double index(const std::vector<double>& values) {
+    double total = 0;
+    for (std::size_t i = 0; i < values.size(); ++i)
+        total += values[i];
+    return total;
+}
+
+inline double iterate(const std::vector<double>& values) {
+    double total = 0;
+    for (double value : values)
+        total += value;
+    return total;
+}
+
+inline std::vector<double> add(const std::vector<double>& x, const std::vector<double>& y) {
+    std::size_t n = x.size() < y.size() ? x.size() : y.size();
+    std::vector<double> z;
+    z.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        z.push_back(x[i] + y[i]);
+    return z;
+}
+
+struct Node {
+    double value;
+    std::shared_ptr<Node> next;
+    explicit Node(double value) : value(value) {}
+};
+
+inline std::shared_ptr<Node> chain(std::size_t n) {
+    auto head = std::make_shared<Node>(0);
+    Node* node = head.get();
+    for (std::size_t i = 1; i < n; ++i) {
+        node->next = std::make_shared<Node>(i);
+        node = node->next.get();
+    }
+    return head;
+}
+
+inline const std::shared_ptr<Node> list = chain(length);
+
+inline double traverse(const Node* node) {
+    double total = 0;
+    for (std::size_t i = 0; i < length; ++i) {
+        total += node->value;
+        node = node->next.get();
+    }
+    return total;
+}
+
+struct Point {
+    double x;
+    double y;
+};
+
+inline std::vector<Point> grid(std::size_t n) {
+    std::vector<Point> points;
+    points.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        points.push_back({i * 0.5, i * 0.25});
+    return points;
+}
+
+inline const std::vector<Point> points = grid(length);
+
+inline double fields(const std::vector<Point>& points) {
+    double total = 0;
+    for (const Point& point : points)
+        total += point.x * point.y;
+    return total;
+}
+
+}
+
+#endif // CIMPLE_BENCH_OVERHEAD_H
@@ -0,0 +1,459 @@
+#ifndef CIMPLE_CANALYSIS_H
+#define CIMPLE_CANALYSIS_H
+
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <unordered_map>
+#include <vector>
+#include "cparse.h"
+
+// Analyses of the syntax tree that let the lowering pass pick cheaper C++ constructs.
+
+// Types passed by value rather than by reference
+inline const std::unordered_set<std::string> primitiveTypes = {
+    "int", "double", "bool", "float", "char", "long", "long long", "unsigned int", "unsigned long", "unsigned char", "size_t"};
+
+// Built-in pipeline functions of the runtime, unless a module defines its own. They only read their sources.
+inline const std::unordered_set<std::string> pipelineFunctions = {"map", "filter", "reduce", "sum", "count", "zip"};
+
+template <typename Visit>
+void visitStmts(const Stmt& stmt, Visit&& visit) {
+    visit(stmt);
+    if (stmt.init)
+        visitStmts(*stmt.init, visit);
+    for (const StmtPtr& child : stmt.body)
+        visitStmts(*child, visit);
+}
+
+// The element type if the expression constructs a `shared[T]` handler, as in shared[T](...),
+// shared[T].new(...) or shared[T].method(...), and nullptr otherwise.
+inline const Type* sharedConstruction(const Expr& expr) {
+    if (expr.kind != Expr::Kind::Call)
+        return nullptr;
+    const Expr* callee = expr.items[0].get();
+    if (callee->kind == Expr::Kind::Member)
+        callee = callee->items[0].get();
+    if (callee->kind != Expr::Kind::Handler || callee->type->name != "shared")
+        return nullptr;
+    return callee->type->element.get();
+}
+
+// Names that an expression uses as values. Accessing `name.field` or calling `name.method()`
+// leaves the object where it is, so such names are not included.
+inline void valueNames(const Expr& expr, std::unordered_set<std::string>& names) {
+    if (expr.kind == Expr::Kind::Name) {
+        names.insert(expr.text);
+        return;
+    }
+    if (expr.kind == Expr::Kind::Inline) {
+        names.insert(expr.raw.begin(), expr.raw.end());
+        return;
+    }
+    if (expr.kind == Expr::Kind::Member && expr.items[0]->kind == Expr::Kind::Name)
+        return;
+    for (const ExprPtr& item : expr.items)
+        valueNames(*item, names);
+}
+
+// Escape analysis: the `shared[T]` locals of a function that are only ever used through member access,
+// and are iterated at most in place. They are never returned, stored, passed on, aliased, unbound,
+// or seen by inline C++, so they can live on the stack instead of behind a reference count.
+inline std::unordered_set<std::string> stackLocals(const Func& func) {
+    std::unordered_map<std::string, int> declarations;
+    std::unordered_set<std::string> candidates;
+    std::unordered_set<std::string> escaped;
+    for (const Param& param : func.params)
+        declarations[param.name]++;
+    for (const StmtPtr& stmt : func.body)
+        visitStmts(*stmt, [&](const Stmt& stmt) {
+            if (stmt.kind == Stmt::Kind::Var || stmt.kind == Stmt::Kind::Declare)
+                declarations[stmt.name]++;
+            for (const std::string& name : stmt.names)
+                declarations[name]++;
+            if (stmt.kind == Stmt::Kind::Var && stmt.value && sharedConstruction(*stmt.value))
+                candidates.insert(stmt.name);
+            if (stmt.kind == Stmt::Kind::Inline)
+                escaped.insert(stmt.raw.begin(), stmt.raw.end());
+            if (stmt.value && !(stmt.kind == Stmt::Kind::ForIn && stmt.value->kind == Expr::Kind::Name))
+                valueNames(*stmt.value, escaped);
+            for (const ExprPtr& argument : stmt.arguments)
+                valueNames(*argument, escaped);
+            for (const ExprPtr& step : stmt.steps)
+                valueNames(*step, escaped);
+        });
+    std::unordered_set<std::string> locals;
+    for (const std::string& name : candidates)
+        if (declarations[name] == 1 && !escaped.count(name))
+            locals.insert(name);
+    return locals;
+}
+
+// Checks that comptime functions and values only use what the compiler can evaluate: primitive parameters,
+// calls to other comptime functions and tables, and no handlers, inline C++, exceptions or generators.
+// `runtime` holds the module variables that are not comptime. Throws with the first construct that is not allowed.
+class ComptimeCheck {
+public:
+    ComptimeCheck(const std::unordered_set<std::string>& functions, const std::unordered_set<std::string>& runtime)
+        : functions(functions), runtime(runtime) {}
+
+    void check(const Func& func) const {
+        if (func.generator)
+            fail("Generators cannot be comptime");
+        for (const Param& param : func.params)
+            if (!primitiveTypes.count(param.type.name))
+                fail("Parameters of comptime functions must have primitive types, but `" + param.name + "` is a " + param.type.name);
+        for (const StmtPtr& stmt : func.body)
+            visitStmts(*stmt, [&](const Stmt& stmt) { check(stmt); });
+    }
+
+    void check(const Expr& expr) const {
+        switch (expr.kind) {
+        case Expr::Kind::Inline:
+            fail("`cimple.unsafe.inline` cannot run at compile time");
+        case Expr::Kind::Handler:
+            fail("`" + expr.type->name + "` handlers cannot be created at compile time. Use `table(size, function)` for constant tables");
+        case Expr::Kind::Name:
+            if (runtime.count(expr.text))
+                fail("`" + expr.text + "` is not a comptime value");
+            break;
+        case Expr::Kind::Call: {
+            const Expr& callee = *expr.items[0];
+            if (callee.kind == Expr::Kind::Name && !functions.count(callee.text) && callee.text != "table")
+                fail("`" + callee.text + "` is not a comptime function");
+            if (callee.kind == Expr::Kind::Member && callee.text != "size")
+                fail("`" + callee.text + "` cannot be called at compile time");
+            break;
+        }
+        default:
+            break;
+        }
+        for (const ExprPtr& item : expr.items)
+            check(*item);
+    }
+
+private:
+    const std::unordered_set<std::string>& functions;
+    const std::unordered_set<std::string>& runtime;
+
+    [[noreturn]] static void fail(const std::string& message) {
+        throw std::runtime_error(message + ".");
+    }
+
+    void check(const Stmt& stmt) const {
+        if (stmt.kind == Stmt::Kind::Inline)
+            fail("`cimple.unsafe.inline` cannot run at compile time");
+        if (stmt.kind == Stmt::Kind::Try || stmt.kind == Stmt::Kind::Unbind || stmt.kind == Stmt::Kind::Yield)
+            fail(std::string("`") + (stmt.kind == Stmt::Kind::Try ? "try" : stmt.kind == Stmt::Kind::Unbind ? "unbind" : "yield") + "` cannot run at compile time");
+        if (stmt.value)
+            check(*stmt.value);
+        for (const ExprPtr& argument : stmt.arguments)
+            check(*argument);
+        for (const ExprPtr& step : stmt.steps)
+            check(*step);
+    }
+};
+
+// Which parameters of functions and which methods of structs only read their objects. Reading depends
+// on the functions and methods that receive the objects, so flags start as read-only and are cleared
+// until nothing changes. Anything the analysis cannot follow counts as a mutation.
+class MutationAnalysis {
+public:
+    explicit MutationAnalysis(const Module& module) {
+        for (const Decl& decl : module.decls) {
+            if (decl.kind == Decl::Kind::Func)
+                functions[decl.func->name].push_back(decl.func.get());
+            if (decl.kind == Decl::Kind::Struct)
+                structs[decl.name] = &decl;
+            if (decl.kind == Decl::Kind::Concept)
+                concepts.insert(decl.name);
+        }
+        for (const auto& [name, overloads] : functions)
+            for (const Func* func : overloads)
+                params[func].assign(func->params.size(), true);
+        for (const auto& [name, decl] : structs)
+            for (const Member& member : decl->members) {
+                if (member.method)
+                    params[member.method.get()].assign(member.method->params.size(), true);
+                if (member.method && !member.method->constructor)
+                    methods[decl->name + "." + member.method->name].push_back(member.method.get());
+            }
+        for (const auto& [name, overloads] : methods)
+            for (const Func* method : overloads)
+                constMethods[method] = true;
+
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto& [func, readOnly] : params)
+                for (size_t i = 0; i < readOnly.size(); ++i)
+                    if (readOnly[i] && mutates(*func, func->params[i].name, func->params[i].type)) {
+                        readOnly[i] = false;
+                        changed = true;
+                    }
+            for (const auto& [name, decl] : structs) {
+                Type owner;
+                owner.name = name;
+                for (const Member& member : decl->members)
+                    if (member.method && !member.method->constructor && constMethods[member.method.get()]
+                            && mutates(*member.method, "self", owner)) {
+                        constMethods[member.method.get()] = false;
+                        changed = true;
+                    }
+            }
+        }
+    }
+
+    bool readOnly(const Func& func, size_t param) const {
+        auto found = params.find(&func);
+        return found != params.end() && found->second[param];
+    }
+    bool constMethod(const Func& method) const {
+        auto found = constMethods.find(&method);
+        return found != constMethods.end() && found->second;
+    }
+    // Structs of at most two primitive fields, which are cheaper to copy than to reach through a reference.
+    bool smallValue(const Type& type) const {
+        auto found = structs.find(type.name);
+        if (found == structs.end())
+            return false;
+        size_t fields = 0;
+        for (const Member& member : found->second->members)
+            if (member.field && (++fields > 2 || !primitiveTypes.count(member.field->type->name)))
+                return false;
+        return true;
+    }
+
+private:
+    std::unordered_map<std::string, std::vector<const Func*>> functions;
+    std::unordered_map<std::string, std::vector<const Func*>> methods; // by struct.method
+    std::unordered_map<std::string, const Decl*> structs;
+    std::unordered_set<std::string> concepts;
+    std::unordered_map<const Func*, std::vector<bool>> params;
+    std::unordered_map<const Func*, bool> constMethods;
+
+    // The name that a chain of member accesses and indexes starts from, if any.
+    static const Expr* root(const Expr& expr) {
+        const Expr* current = &expr;
+        while (current->kind == Expr::Kind::Member || current->kind == Expr::Kind::Index || current->kind == Expr::Kind::Paren)
+            current = current->items[0].get();
+        return current->kind == Expr::Kind::Name ? current : nullptr;
+    }
+
+    // Type of a chain that starts from the tracked object, through struct fields and vector and map elements.
+    const Type* typeOf(const Expr& expr, const std::string& name, const Type& type) const {
+        if (expr.kind == Expr::Kind::Name)
+            return expr.text == name ? &type : nullptr;
+        if (expr.kind == Expr::Kind::Paren)
+            return typeOf(*expr.items[0], name, type);
+        if (expr.kind != Expr::Kind::Member && expr.kind != Expr::Kind::Index)
+            return nullptr;
+        const Type* object = typeOf(*expr.items[0], name, type);
+        while (object && object->name == "shared")
+            object = object->element.get();
+        if (!object)
+            return nullptr;
+        if (expr.kind == Expr::Kind::Index)
+            return object->name == "vector" ? object->element.get() : object->name == "map" ? object->value.get() : nullptr;
+        auto found = structs.find(object->name);
+        if (found == structs.end())
+            return nullptr;
+        for (const Member& member : found->second->members)
+            if (member.field && member.field->name == expr.text)
+                return member.field->type.get();
+        return nullptr;
+    }
+
+    bool rooted(const Expr& expr, const std::string& name) const {
+        const Expr* start = root(expr);
+        return start && start->text == name;
+    }
+
+    bool readOnlyCall(const Type* object, const std::string& method) const {
+        while (object && object->name == "shared")
+            object = object->element.get();
+        if (!object)
+            return false;
+        if (object->name == "vector")
+            return method == "size" || method == "empty";
+        if (object->name == "map")
+            return method == "get" || method == "has" || method == "size" || method == "empty";
+        if (object->name == "str" || object->name == "str_view")
+            return true; // immutable
+        auto found = methods.find(object->name + "." + method);
+        if (found == methods.end() || found->second.size() != 1)
+            return false;
+        return constMethods.at(found->second[0]);
+    }
+
+    // Whether the object may change when passed as the argument at `index` of `call`.
+    bool readOnlyArgument(const Expr& call, size_t index, const Type* type) const {
+        if (type && primitiveTypes.count(type->name))
+            return true; // copied
+        const Expr& callee = *call.items[0];
+        if (callee.kind != Expr::Kind::Name)
+            return false;
+        // user functions hide the built-in ones of the same name, as in the lowering
+        auto found = functions.find(callee.text);
+        if (found == functions.end() && (callee.text == "print" || callee.text == "string" || callee.text == "format" || callee.text == "keep"))
+            return true;
+        if (found == functions.end() && pipelineFunctions.count(callee.text))
+            return true;
+        if (found == functions.end() || found->second.size() != 1 || index > found->second[0]->params.size())
+            return false;
+        const Func& func = *found->second[0];
+        const Type& param = func.params[index - 1].type;
+        if (concepts.count(param.name) || primitiveTypes.count(param.name))
+            return true;
+        if (func.generator && !smallValue(param))
+            return false; // generators take such parameters as non-const references, like mutated ones
+        return params.at(&func)[index - 1];
+    }
+
+    bool mutates(const Expr& expr, const std::string& name, const Type& type) const {
+        switch (expr.kind) {
+        case Expr::Kind::Assign:
+            if (rooted(*expr.items[0], name))
+                return true;
+            break;
+        case Expr::Kind::Unary:
+        case Expr::Kind::Postfix:
+            if ((expr.text == "++" || expr.text == "--") && rooted(*expr.items[0], name))
+                return true;
+            break;
+        case Expr::Kind::Inline:
+            for (const std::string& token : expr.raw)
+                if (token == name)
+                    return true;
+            return false;
+        case Expr::Kind::Call: {
+            const Expr& callee = *expr.items[0];
+            if (callee.kind == Expr::Kind::Member && rooted(*callee.items[0], name)
+                    && !readOnlyCall(typeOf(*callee.items[0], name, type), callee.text))
+                return true;
+            for (size_t i = 1; i < expr.items.size(); ++i) {
+                const Expr& argument = *expr.items[i];
+                if (rooted(argument, name) ? !readOnlyArgument(expr, i, typeOf(argument, name, type)) : mutates(argument, name, type))
+                    return true;
+            }
+            return callee.kind != Expr::Kind::Member && mutates(callee, name, type);
+        }
+        default:
+            break;
+        }
+        for (const ExprPtr& item : expr.items)
+            if (mutates(*item, name, type))
+                return true;
+        return false;
+    }
+
+    bool mutates(const Func& func, const std::string& name, const Type& type) const {
+        bool mutated = false;
+        for (const StmtPtr& stmt : func.body)
+            visitStmts(*stmt, [&](const Stmt& stmt) {
+                if (mutated)
+                    return;
+                if (stmt.kind == Stmt::Kind::Unbind && rooted(*stmt.value, name))
+                    mutated = true;
+                else if (stmt.kind == Stmt::Kind::Inline)
+                    for (const std::string& token : stmt.raw)
+                        mutated = mutated || token == name;
+                else if (stmt.value && mutates(*stmt.value, name, type))
+                    mutated = true;
+                for (const ExprPtr& argument : stmt.arguments)
+                    mutated = mutated || mutates(*argument, name, type);
+                for (const ExprPtr& step : stmt.steps)
+                    mutated = mutated || mutates(*step, name, type);
+            });
+        return mutated;
+    }
+};
+
+// Dead code elimination for imported modules: which declarations are reachable from the names that the importing
+// module uses, and which names each of this module's imports is used for in turn. References are read from the tokens
+// of each declaration, so that names in types and inline C++ count too. `used` is nullptr for the module of `main`,
+// which keeps everything. Module variables that do more than name a value or inline C++ are always kept, since
+// creating them may have side effects.
+class Reachability {
+public:
+    Reachability(const Module& module, const std::vector<std::string>& tokens, const std::unordered_set<std::string>* used)
+        : kept(module.decls.size(), !used) {
+        std::unordered_map<std::string, std::vector<size_t>> declared;
+        for (size_t i = 0; i < module.decls.size(); ++i) {
+            const Decl& decl = module.decls[i];
+            if (decl.kind == Decl::Kind::Import) {
+                imports[decl.name];
+                scopes["cimple_" + decl.name] = decl.name;
+            }
+            if (decl.kind == Decl::Kind::Func)
+                declared[decl.func->name].push_back(i);
+            else if (decl.kind == Decl::Kind::Struct || decl.kind == Decl::Kind::Concept)
+                declared[decl.name].push_back(i);
+            else if (decl.kind == Decl::Kind::Statement && !decl.statement->name.empty() && pure(*decl.statement))
+                declared[decl.statement->name].push_back(i);
+            else if (decl.kind != Decl::Kind::Include)
+                kept[i] = true; // imports, fetches, bench blocks and statements with possible side effects
+        }
+        if (used)
+            for (const std::string& name : *used)
+                for (size_t i : declared[name])
+                    kept[i] = true;
+
+        std::vector<size_t> pending;
+        for (size_t i = 0; i < kept.size(); ++i)
+            if (kept[i])
+                pending.push_back(i);
+        while (!pending.empty()) {
+            size_t i = pending.back();
+            pending.pop_back();
+            size_t end = i + 1 < module.decls.size() ? module.decls[i + 1].position : tokens.size();
+            for (size_t at = module.decls[i].position; at < end; ++at) {
+                // `alias.name` in cimple code, `cimple_alias::name` in inline C++
+                auto import = imports.find(tokens[at]);
+                if (import != imports.end() && at + 2 < end && tokens[at + 1] == ".")
+                    import->second.insert(tokens[at + 2]);
+                auto scope = scopes.find(tokens[at]);
+                if (scope != scopes.end()) {
+                    size_t name = at + 1;
+                    while (name < end && (tokens[name] == ":" || tokens[name] == "::"))
+                        ++name;
+                    if (name < end && name > at + 1)
+                        imports[scope->second].insert(tokens[name]);
+                }
+                auto found = declared.find(tokens[at]);
+                if (found == declared.end())
+                    continue;
+                for (size_t reference : found->second)
+                    if (!kept[reference]) {
+                        kept[reference] = true;
+                        pending.push_back(reference);
+                    }
+            }
+        }
+        // includes only serve the declarations of their module
+        bool any = false;
+        for (size_t i = 0; i < kept.size(); ++i)
+            any = any || (kept[i] && module.decls[i].kind != Decl::Kind::Import && module.decls[i].kind != Decl::Kind::Get);
+        for (size_t i = 0; i < kept.size(); ++i)
+            if (module.decls[i].kind == Decl::Kind::Include)
+                kept[i] = any;
+    }
+
+    bool keep(size_t decl) const { return kept[decl]; }
+    // Names that the kept declarations use from the module imported as `name`
+    const std::unordered_map<std::string, std::unordered_set<std::string>>& uses() const { return imports; }
+
+private:
+    std::vector<bool> kept;
+    std::unordered_map<std::string, std::unordered_set<std::string>> imports;
+    std::unordered_map<std::string, std::string> scopes; // namespace of each import in the generated code
+
+    static bool pure(const Stmt& stmt) {
+        if (stmt.comptime || !stmt.value)
+            return stmt.kind == Stmt::Kind::Var || stmt.kind == Stmt::Kind::Declare;
+        Expr::Kind kind = stmt.value->kind;
+        return kind == Expr::Kind::Inline || kind == Expr::Kind::Number || kind == Expr::Kind::String || kind == Expr::Kind::Char;
+    }
+};
+
+
+#endif // CIMPLE_CANALYSIS_H
@@ -3,75 +3,378 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
 #include <sys/socket.h>
-#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <fstream>
 
-int create_socket(const std::string& host, int port) {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+// Minimal HTTP/1.1 client to fetch cimple modules. Connections are kept alive and reused for
+// consecutive files of the same host, bodies are streamed to disk in large chunks, both
+// Content-Length and chunked bodies are understood, and interrupted downloads resume
+// from their `.part` file with a Range request. Only plain http is supported.
+
+struct Url {
+    std::string host;
+    int port = 80;
+    std::string resource = "/";
+};
+
+inline bool parse_url(const std::string& url, Url& parsed) {
+    std::string_view rest(url);
+    if (rest.substr(0, 7) == "http://")
+        rest.remove_prefix(7);
+    else if (rest.find("://") != std::string_view::npos) {
+        std::cerr << "Only http:// urls can be fetched: " << url << "\n";
+        return false;
+    }
+    size_t slash = rest.find('/');
+    std::string_view authority = rest.substr(0, slash);
+    parsed.resource = slash == std::string_view::npos ? "/" : std::string(rest.substr(slash));
+    size_t colon = authority.find(':');
+    parsed.host = std::string(authority.substr(0, colon));
+    parsed.port = colon == std::string_view::npos ? 80 : std::atoi(std::string(authority.substr(colon + 1)).c_str());
+    if (parsed.host.empty() || parsed.port <= 0) {
+        std::cerr << "Invalid url: " << url << "\n";
+        return false;
+    }
+    return true;
+}
+
+inline int create_socket(const std::string& host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+    if (error) {
+        std::cerr << "No such host " << host << ": " << gai_strerror(error) << "\n";
+        return -1;
+    }
+    int sockfd = -1;
+    for (addrinfo* address = addresses; address; address = address->ai_next) {
+        sockfd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (sockfd < 0)
+            continue;
+        if (connect(sockfd, address->ai_addr, address->ai_addrlen) == 0)
+            break;
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(addresses);
     if (sockfd < 0) {
-        std::cerr << "Error creating socket.\n";
+        std::cerr << "Error connecting to " << host << ":" << port << ".\n";
         return -1;
     }
+    int enable = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return sockfd;
+}
 
-    struct hostent *server = gethostbyname(host.c_str());
-    if (!server) {
-        std::cerr << "No such host.\n";
-        return -1;
+// One keep-alive connection with its own receive buffer, so that headers and chunk sizes
+// are parsed in place instead of being copied out of every received block.
+class HttpConnection {
+public:
+    static constexpr size_t buffer_size = 1 << 18;
+
+    HttpConnection(const std::string& host, int port) : host(host), port(port), buffer(buffer_size) {}
+    ~HttpConnection() { disconnect(); }
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+
+    // Downloads `resource` to `path`. Returns false and reports to std::cerr on failure.
+    bool get(const std::string& resource, const std::string& path) {
+        bool restarted = false;
+        // a reused connection may have been closed by the server in the meantime, so retry once on a fresh one
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            bool reused = sockfd >= 0;
+            if (!reused && (sockfd = create_socket(host, port)) < 0)
+                return false;
+            Result result = fetch(resource, path);
+            if (result == Result::done)
+                return true;
+            if (result == Result::restart && !restarted) {
+                restarted = true;
+                --attempt;
+                continue;
+            }
+            disconnect();
+            if (result != Result::dropped || !reused)
+                return false;
+        }
+        return false;
     }
 
-    struct sockaddr_in server_addr;
-    std::memset((char *)&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    std::memcpy((char *)&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    server_addr.sin_port = htons(port);
+private:
+    enum class Result { done, failed, dropped, restart }; // restart: the partial file was dropped, so fetch the whole resource
 
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Error connecting to server.\n";
-        return -1;
+    std::string host;
+    int port;
+    int sockfd = -1;
+    std::vector<char> buffer;
+    size_t start = 0;
+    size_t stop = 0;
+
+    void disconnect() {
+        if (sockfd >= 0)
+            close(sockfd);
+        sockfd = -1;
+        start = stop = 0;
     }
 
-    return sockfd;
-}
+    bool send_all(const std::string& data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t count = send(sockfd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            sent += count;
+        }
+        return true;
+    }
 
-void download_file(const std::string& host, const std::string& resource, const std::string& path, int port=80) {
-    int sockfd = create_socket(host, port);
-    if (sockfd < 0) {
-        std::cerr << "Failed to create socket.\n";
-        return;
+    bool receive() {
+        if (start == stop)
+            start = stop = 0;
+        else if (stop == buffer.size()) {
+            std::memmove(buffer.data(), buffer.data() + start, stop - start);
+            stop -= start;
+            start = 0;
+        }
+        while (true) {
+            ssize_t count = recv(sockfd, buffer.data() + stop, buffer.size() - stop, 0);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            stop += count;
+            return true;
+        }
     }
 
-    std::string request = "GET " + resource + " HTTP/1.1\r\n";
-    request += "Host: " + host + "\r\n";
-    request += "Connection: close\r\n\r\n";
-    send(sockfd, request.c_str(), request.size(), 0);
-
-    std::ofstream outfile(path, std::ios::binary);
-    char buffer[4096];
-    bool header_ended = false;
-    while (true) {
-        ssize_t bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            break;
+    bool read_line(std::string_view& line) {
+        while (true) {
+            const char* from = buffer.data() + start;
+            const char* end = static_cast<const char*>(std::memchr(from, '\n', stop - start));
+            if (end) {
+                size_t length = end - from;
+                start += length + 1;
+                if (length && from[length - 1] == '\r')
+                    --length;
+                line = std::string_view(from, length);
+                return true;
+            }
+            if (start == 0 && stop == buffer.size())
+                return false; // header line longer than the whole buffer
+            if (!receive())
+                return false;
         }
-        if (!header_ended) {
-            std::string response(buffer, bytes_received);
-            size_t header_end = response.find("\r\n\r\n");
-            if (header_end != std::string::npos) {
-                header_ended = true;
-                outfile.write(response.c_str() + header_end + 4, bytes_received - header_end - 4);
+    }
+
+    // Streams up to `length` bytes of body (or everything until the connection closes if `length` is npos).
+    bool copy_body(int fd, size_t length) {
+        while (length) {
+            if (start == stop && !receive())
+                return length == std::string::npos;
+            size_t count = std::min(stop - start, length);
+            for (size_t written = 0; written < count;) {
+                ssize_t result = write(fd, buffer.data() + start + written, count - written);
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0)
+                    return false;
+                written += result;
+            }
+            start += count;
+            if (length != std::string::npos)
+                length -= count;
+        }
+        return true;
+    }
+
+    Result fetch(const std::string& resource, const std::string& path) {
+        std::string partial = path + ".part";
+        struct stat info;
+        size_t offset = stat(partial.c_str(), &info) == 0 ? info.st_size : 0;
+
+        std::string request = "GET " + resource + " HTTP/1.1\r\n";
+        request += "Host: " + host + (port == 80 ? "" : ":" + std::to_string(port)) + "\r\n";
+        if (offset)
+            request += "Range: bytes=" + std::to_string(offset) + "-\r\n";
+        request += "Connection: keep-alive\r\n\r\n";
+        if (!send_all(request))
+            return Result::dropped;
+
+        std::string_view line;
+        if (!read_line(line))
+            return Result::dropped;
+        if (line.substr(0, 5) != "HTTP/" || line.size() < 12) {
+            std::cerr << "Malformed response from " << host << ".\n";
+            return Result::failed;
+        }
+        int status = std::atoi(std::string(line.substr(9, 3)).c_str());
+        size_t content_length = std::string::npos;
+        size_t range_start = std::string::npos; // of Content-Range: bytes first-last/total, or bytes */total
+        size_t range_total = std::string::npos;
+        bool chunked = false;
+        bool keep_alive = line.substr(0, 8) != "HTTP/1.0";
+        while (true) {
+            if (!read_line(line))
+                return Result::failed;
+            if (line.empty())
+                break;
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos)
+                continue;
+            std::string name(line.substr(0, colon));
+            for (char& c : name)
+                c = std::tolower(static_cast<unsigned char>(c));
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ')
+                value.remove_prefix(1);
+            if (name == "content-length")
+                content_length = std::strtoull(std::string(value).c_str(), nullptr, 10);
+            else if (name == "transfer-encoding")
+                chunked = value.find("chunked") != std::string_view::npos;
+            else if (name == "content-range" && value.substr(0, 6) == "bytes " && value.size() > 6) {
+                std::string range(value.substr(6));
+                size_t slash = range.find('/');
+                if (range[0] != '*')
+                    range_start = std::strtoull(range.c_str(), nullptr, 10);
+                if (slash != std::string::npos && slash + 1 < range.size() && range[slash + 1] != '*')
+                    range_total = std::strtoull(range.c_str() + slash + 1, nullptr, 10);
             }
-        } else {
-            outfile.write(buffer, bytes_received);
+            else if (name == "connection")
+                keep_alive = value.find("close") == std::string_view::npos && value.find("Close") == std::string_view::npos;
+        }
+
+        // a resumed download only continues the partial file if the server agrees on where it ends,
+        // since the resource may have shrunk or changed since it was started
+        if ((status == 416 && offset && range_total != offset) || (status == 206 && range_start != offset)) {
+            std::cerr << "The partial download of " << host << resource << " does not match the resource any more, so it starts over.\n";
+            if (!skip_body(chunked, content_length) || !keep_alive)
+                disconnect();
+            unlink(partial.c_str());
+            return Result::restart;
+        }
+        if (status == 416 && offset) {
+            // the partial file already holds the whole resource
+            if (!skip_body(chunked, content_length) || std::rename(partial.c_str(), path.c_str()) != 0)
+                return Result::failed;
+            return finish(keep_alive);
+        }
+        if (status != 200 && status != 206) {
+            std::cerr << "Server responded with status " << status << " for " << host << resource << ".\n";
+            skip_body(chunked, content_length);
+            disconnect();
+            return Result::failed;
+        }
+
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (status == 206 ? O_APPEND : O_TRUNC);
+        int fd = open(partial.c_str(), flags, 0644);
+        if (fd < 0) {
+            std::cerr << "Could not open file for writing: " << partial << "\n";
+            return Result::failed;
         }
+        bool complete = chunked ? copy_chunks(fd) : copy_body(fd, content_length);
+        close(fd);
+        if (!complete) {
+            std::cerr << "Download of " << host << resource << " was interrupted; it resumes from " << partial << " next time.\n";
+            return Result::failed;
+        }
+        if (std::rename(partial.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not move " << partial << " to " << path << "\n";
+            return Result::failed;
+        }
+        if (content_length == std::string::npos && !chunked)
+            keep_alive = false; // the body was delimited by closing the connection
+        return finish(keep_alive);
+    }
+
+    bool copy_chunks(int fd) {
+        std::string_view line;
+        while (true) {
+            if (!read_line(line))
+                return false;
+            size_t length = std::strtoull(std::string(line).c_str(), nullptr, 16);
+            if (length == 0)
+                break;
+            if (!copy_body(fd, length) || !read_line(line))
+                return false;
+        }
+        // trailers end with an empty line
+        while (read_line(line) && !line.empty()) {}
+        return true;
+    }
+
+    bool skip_body(bool chunked, size_t content_length) {
+        int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        bool complete = chunked ? copy_chunks(fd) : content_length != std::string::npos && copy_body(fd, content_length);
+        close(fd);
+        return complete;
     }
-    close(sockfd);
-    outfile.close();
+
+    Result finish(bool keep_alive) {
+        if (!keep_alive)
+            disconnect();
+        return Result::done;
+    }
+};
+
+struct Download {
+    std::string url;
+    std::string path;
+};
+
+// Downloads every file with up to `parallel` threads. Each thread keeps one connection per host
+// alive across its files. Returns whether each download succeeded, in the order given.
+inline std::vector<bool> download_files(const std::vector<Download>& downloads, size_t parallel = 4) {
+    std::vector<char> succeeded(downloads.size(), false);
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        std::unordered_map<std::string, std::unique_ptr<HttpConnection>> connections;
+        for (size_t i = next++; i < downloads.size(); i = next++) {
+            Url url;
+            if (!parse_url(downloads[i].url, url))
+                continue;
+            auto& connection = connections[url.host + ":" + std::to_string(url.port)];
+            if (!connection)
+                connection = std::make_unique<HttpConnection>(url.host, url.port);
+            succeeded[i] = connection->get(url.resource, downloads[i].path);
+        }
+    };
+    parallel = std::max<size_t>(1, std::min(parallel, downloads.size()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < parallel; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+    return std::vector<bool>(succeeded.begin(), succeeded.end());
+}
+
+inline bool download_file(const std::string& host, const std::string& resource, const std::string& path, int port=80) {
+    HttpConnection connection(host, port);
+    if (!connection.get(resource, path))
+        return false;
     std::cout << "File downloaded successfully to " << path << "\n";
+    return true;
 }
 
 
-#endif // CIMPLE_CGET_H
\ No newline at end of file
+#endif // CIMPLE_CGET_H
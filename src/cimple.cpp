@@ -7,211 +7,1248 @@
 #include <unordered_map>
 #include <cctype>
 #include <stdexcept>
-//#include "src/cget.h"
+#include <spawn.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <climits>
+#include <algorithm>
+#include "cstore.h"
+#include "cparse.h"
+#include "canalysis.h"
+#include "ctokens.h"
+#include "cscan.h"
 
+extern char** environ;
 
-bool isNumber(const std::string& str) {
-    std::istringstream ss(str);
-    double d;
-    char c;
-    // Try to parse as a double and check for leftover characters
-    return ss >> d && !(ss >> c);
-}
 
 // g++ src/cimple.cpp -o cimple -O2 -std=c++20
-std::vector<std::string> tokenize(const std::string& content) {
+// Splits source code into tokens, recording where each one starts in `locations`.
+std::vector<std::string> tokenize(const std::string& content, std::vector<Location>& locations) {
     std::vector<std::string> tokens;
-    std::string token;
-    bool in_string = false;
-
-    for (size_t i = 0; i < content.size(); ++i) {
-        char c = content[i];
+    const char* data = content.data();
+    size_t size = content.size();
+    locations.clear();
+    tokens.reserve(size / 3); // code rarely has more tokens than this, so large modules are not moved as they grow
+    locations.reserve(size / 3);
 
-        // Check for start of line comment
-        if (!in_string && c == '/' && i + 1 < content.size() && content[i + 1] == '/') {
-            // Skip until end of line
-            while (i < content.size() && content[i] != '\n') {
-                ++i;
+    // counts lines up to `offset`, which only moves forward
+    Location here{1, 1};
+    size_t counted = 0;
+    auto locate = [&](size_t offset) {
+        while (counted < offset) {
+            const void* newline = std::memchr(data + counted, '\n', offset - counted);
+            if (!newline) {
+                here.column += offset - counted;
+                counted = offset;
+                break;
             }
-            continue;
+            counted = static_cast<const char*>(newline) - data + 1;
+            ++here.line;
+            here.column = 1;
         }
+        return here;
+    };
+    auto push = [&](size_t start, size_t end) {
+        tokens.emplace_back(data + start, end - start);
+        locations.push_back(locate(start));
+    };
 
-        // Check for start or end of a quoted string
-        if (c == '"' && (i == 0 || content[i - 1] != '\\')) {
-            if (in_string) {
-                token += c;
-                tokens.push_back(token);
-                token.clear();
-                in_string = false;
-            } else {
-                if (!token.empty()) {
-                    tokens.push_back(token);
-                    token.clear();
-                }
-                in_string = true;
-                token += c;
-            }
-            continue;
-        }
+    for (size_t i = 0; i < size;) {
+        char c = data[i];
+        ByteClass kind = byteClass(c);
 
-        // Handle characters inside a string without further splitting
-        if (in_string) {
-            token += c;
-            continue;
+        // Words run until whitespace or punctuation, so underscores stay in names
+        if (kind == ByteClass::Word) {
+            size_t end = wordEnd(data, i, size);
+            push(i, end);
+            i = end;
         }
-
-        // Split on whitespace or punctuation, but don't split on underscore
-        if (std::isspace(static_cast<unsigned char>(c)) || (std::ispunct(static_cast<unsigned char>(c)) && c != '_')) {
-            if (!token.empty()) {
-                tokens.push_back(token);
-                token.clear();
-            }
-            if (std::ispunct(static_cast<unsigned char>(c)) && c != '_') {
-                tokens.push_back(std::string(1, c));
-            }
-        } else {
-            token += c;
+        else if (kind == ByteClass::Space)
+            i = spaceEnd(data, i, size);
+        // Skip line comments until the end of the line
+        else if (c == '/' && i + 1 < size && data[i + 1] == '/') {
+            const void* newline = std::memchr(data + i, '\n', size - i);
+            i = newline ? static_cast<const char*>(newline) - data : size;
+        }
+        // Keep quoted strings whole, up to the first quote that is not escaped
+        else if (c == '"' && !escaped(data, i)) {
+            size_t end = stringEnd(data, i, size);
+            push(i, end);
+            i = end;
+        }
+        else {
+            push(i, i + 1);
+            ++i;
         }
     }
+    return tokens;
+}
 
-    // Add any remaining token
-    if (!token.empty()) {
-        tokens.push_back(token);
+// Modules fetched with `cimple.get`, shared by all imports of a build
+static PackageStore packages;
+// Tokens of modules read by earlier processes, by the content hash of their source
+static TokenCache tokenCache(packages.directory() + "/tokens");
+
+// Tokens of every module read so far, reused while its file is unchanged (this keeps the compile server warm)
+struct CachedModule {
+    timespec modified;
+    off_t size;
+    std::vector<std::string> tokens;
+    std::vector<Location> locations;
+};
+static std::unordered_map<std::string, CachedModule> moduleCache;
+// Real paths of the modules read by the current build, which `--watch` waits on
+static std::vector<std::string> loadedFiles;
+
+bool loadTokens(const std::string& filename, std::vector<std::string>& tokens, std::vector<Location>& locations) {
+    struct stat info;
+    char path[PATH_MAX];
+    if (stat(filename.c_str(), &info) != 0 || !realpath(filename.c_str(), path))
+        return false;
+    auto cached = moduleCache.find(path);
+    if (cached != moduleCache.end() && cached->second.size == info.st_size
+            && cached->second.modified.tv_sec == info.st_mtim.tv_sec && cached->second.modified.tv_nsec == info.st_mtim.tv_nsec) {
+        tokens = cached->second.tokens;
+        locations = cached->second.locations;
+        loadedFiles.push_back(path);
+        return true;
+    }
+    std::ifstream infile(filename);
+    if (!infile.is_open())
+        return false;
+    std::stringstream buffer;
+    buffer << infile.rdbuf();
+    std::string content = buffer.str();
+    std::string hash = content_hash(content);
+    if (!tokenCache.load(hash, tokens, locations)) {
+        tokens = tokenize(content, locations);
+        tokenCache.save(hash, tokens, locations);
     }
+    moduleCache[path] = CachedModule{info.st_mtim, info.st_size, tokens, locations};
+    loadedFiles.push_back(path);
+    return true;
+}
 
-    return tokens;
+// Size and modification time of a file, which change whenever it is saved
+std::string fileStamp(const std::string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return "";
+    return std::to_string(info.st_size) + " " + std::to_string(info.st_mtim.tv_sec) + "." + std::to_string(info.st_mtim.tv_nsec);
+}
+
+// Directory whose std/ holds the standard modules and their headers, found next to the cimple executable rather than
+// in the working directory: the executable's own directory, as in a checkout of this repository, its parent, or
+// share/cimple under the prefix it is installed to. The working directory is the last resort.
+const std::string& installDirectory() {
+    static const std::string directory = [] {
+        char path[PATH_MAX];
+        if (!realpath("/proc/self/exe", path))
+            return std::string(".");
+        std::string bin(path);
+        bin = bin.substr(0, bin.find_last_of('/'));
+        for (const std::string& candidate : {bin, bin + "/..", bin + "/../share/cimple"}) {
+            struct stat info;
+            if (stat((candidate + "/std").c_str(), &info) == 0 && S_ISDIR(info.st_mode) && realpath(candidate.c_str(), path))
+                return std::string(path);
+        }
+        return std::string(".");
+    }();
+    return directory;
 }
 
 
+// Imported modules as lowered by earlier builds of this process, which are reused while none of their files change
+struct LoweredModule {
+    std::vector<std::string> tokens;
+    std::vector<std::string> preample; // what the module added to the preample
+    std::vector<std::string> files;    // the module and the modules it imports
+    std::vector<std::string> stamps;   // of the files when they were read
+    bool profiling;
+    bool memoryStats;
+};
+static std::unordered_map<std::string, LoweredModule> loweredModules;
 
-// Primitive types that should not be converted to const Type&
-static std::unordered_set<std::string> primitiveTypes = {"int", "double", "bool"};
+// Set by buildFile for `--profile` builds, which time every func and method, also writing a Chrome trace to `profileTrace` if set
+static bool profiling = false;
+static std::string profileTrace;
+// Set by buildFile for `--memstats` builds, which count the allocations of vectors and shared values
+static bool memoryStats = false;
 
-// Recursive function to parse types with nesting
-std::string parseType(const std::vector<std::string>& tokens, int& pos, const std::unordered_set<std::string>& conceptNames, bool declaring, bool& isConstructorCall, int start_pos) {
-    if (pos >= tokens.size()) {
-        throw std::runtime_error("Unexpected end of tokens while parsing type.");
+// Text placed inside a string literal of the generated code
+std::string escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
     }
-    
-    std::string type = "";
-    while (pos < tokens.size()) {
-        std::string current = tokens[pos];
+    return escaped;
+}
 
-        if (current == "vector" || current == "shared") {
-            std::string templateName;
-            bool isShared = (current == "shared");
-            pos++; // Move past 'vector' or 'shared'
 
-            if (pos >= tokens.size() || tokens[pos] != "[") {
-                throw std::runtime_error("Expected '[' after " + current);
-            }
-            pos++; // Move past '['
+std::vector<std::string> transformTokens(const std::vector<std::string>& tokens, const std::vector<Location>& locations, bool injectExtras, std::vector<std::string>& preample, const std::string &transpilation_depth, const std::string &directory, const std::string &filename,
+                                         const std::unordered_set<std::string>* used = nullptr);
 
-            // Start parsing the nested type
-            std::string nestedType = parseType(tokens, pos, conceptNames, false, isConstructorCall, start_pos);
+// Second pass of the transpiler: lowers the syntax tree of a module to C++ tokens, which buildFile lays out.
+class Lowering {
+public:
+    // `program` is set for the module of `main`, as opposed to imported modules, and `module` is the file that it was read from,
+    // whose lines the generated code points back to with `#line` directives. Declarations that `reachable` does not keep are left out.
+    Lowering(std::vector<std::string>& out, std::vector<std::string>& preample, const std::string& depth, const std::string& directory,
+             const std::string& module, const std::vector<Location>& locations, const Reachability& reachable, bool program)
+        : out(out), preample(preample), depth(depth), directory(directory), module(module), locations(locations), reachable(reachable), program(program) {}
 
-            // Expect closing ']'
-            if (pos >= tokens.size() || tokens[pos] != "]") {
-                throw std::runtime_error("Expected ']' after type parameters.");
-            }
-            pos++; // Move past ']'
+    void lower(const Module& module) {
+        for (const Decl& decl : module.decls)
+            if (decl.kind == Decl::Kind::Concept)
+                concepts.insert(decl.name);
+            else if (decl.kind == Decl::Kind::Func)
+                functions.insert(decl.func->name);
+            else if (decl.kind == Decl::Kind::Bench)
+                benchmarks++;
+        std::unordered_set<std::string> comptimeFunctions;
+        std::unordered_set<std::string> runtimeValues;
+        for (const Decl& decl : module.decls)
+            if (decl.kind == Decl::Kind::Func && decl.func->comptime)
+                comptimeFunctions.insert(decl.func->name);
+            else if (decl.kind == Decl::Kind::Statement && !decl.statement->comptime && !decl.statement->name.empty())
+                runtimeValues.insert(decl.statement->name);
+        ComptimeCheck check(comptimeFunctions, runtimeValues);
+        comptimeCheck = &check;
+        MutationAnalysis analysis(module);
+        mutations = &analysis;
+        for (size_t i = 0; i < module.decls.size(); ++i)
+            if (reachable.keep(i))
+                lower(module.decls[i]);
+        if (program && benchmarks && !functions.count("main"))
+            emit("int main() { return cimple::bench::run(); }\n");
+        mutations = nullptr;
+        comptimeCheck = nullptr;
+    }
+
+private:
+    std::vector<std::string>& out;
+    std::vector<std::string>& preample;
+    const std::string& depth;
+    const std::string& directory;
+    const std::string& module;
+    const std::vector<Location>& locations;
+    const Reachability& reachable;
+    uint32_t line = 0; // source line of the last `#line` directive
+    bool program;
+    size_t benchmarks = 0;
+    size_t benchmark = 0; // number of the next bench block
+    std::unordered_set<std::string> concepts;
+    std::unordered_set<std::string> functions;
+    std::unordered_set<std::string> namespaces = {"cimple"};
+    bool inConcept = false;
+    std::string structure; // name of the struct whose methods are lowered
+    std::string memoryFunc; // `--memstats` name of the func being lowered, if its lines are allocation sites
+    bool generator = false;
+    bool comptime = false;
+    std::unordered_set<std::string> stackValues;
+    const MutationAnalysis* mutations = nullptr;
+    const ComptimeCheck* comptimeCheck = nullptr;
+
+    void emit(std::string token) { out.push_back(std::move(token)); }
+
+    // Maps the code that follows to the source line of the token at `position`, so that compiler errors, debuggers and
+    // profilers point at the .cm file. Directives need a line of their own, so they are only placed where one starts.
+    void locate(size_t position) {
+        if (position >= locations.size() || locations[position].line == line)
+            return;
+        if (!out.empty()) {
+            const std::string& last = out.back();
+            if (last.empty() || !(last.back() == '{' || last.back() == ';' || last.back() == '\n' || last[0] == '}' || last[0] == '#'))
+                return;
+        }
+        line = locations[position].line;
+        emit("#line " + std::to_string(line) + " \"" + escape(module) + "\"");
+    }
+
+    std::string scope(const std::string& name) const {
+        return name == "cimple" ? name : "cimple_" + name;
+    }
+
+    std::string type(const Type& type) const {
+        if (type.name == "vector")
+            return "SafeVector<" + this->type(*type.element) + ">";
+        if (type.name == "shared")
+            return "SafeSharedPtr<" + this->type(*type.element) + ">";
+        if (type.name == "map")
+            return "SafeMap<" + this->type(*type.element) + ", " + this->type(*type.value) + ">";
+        if (type.name == "str" || type.name == "str_view")
+            return "cimple::" + type.name;
+        if (type.name == "gen")
+            return "cimple::Generator<" + this->type(*type.element) + ">";
+        size_t dot = type.name.find('.');
+        if (dot != std::string::npos && namespaces.count(type.name.substr(0, dot))) {
+            std::string scoped = scope(type.name.substr(0, dot)) + "::" + type.name.substr(dot + 1);
+            for (size_t i = 0; i < scoped.size(); ++i)
+                if (scoped[i] == '.')
+                    scoped.replace(i, 1, "::");
+            return scoped;
+        }
+        return type.name;
+    }
+
+    std::string constructor(const Type& type) const {
+        if (type.name == "shared")
+            return "make_safe_shared<" + this->type(*type.element) + ">";
+        return this->type(type);
+    }
+
+    // `handler[type].method(...)`, which constructs the handler and calls a method on it
+    static bool handlerMethod(const Expr& expr) {
+        return expr.kind == Expr::Kind::Call && expr.items[0]->kind == Expr::Kind::Member
+            && expr.items[0]->items[0]->kind == Expr::Kind::Handler && expr.items[0]->text != "new";
+    }
+
+    void arguments(const Expr& call) {
+        emit("(");
+        for (size_t i = 1; i < call.items.size(); ++i) {
+            if (i > 1)
+                emit(",");
+            expr(*call.items[i]);
+        }
+        emit(")");
+    }
 
-            // Check if the next token is '(' to determine if it's a constructor call
-            int lookahead = pos;
-            while (lookahead < tokens.size() && tokens[lookahead] == " ") {
-                lookahead++;
+    // Operands that follow an operator, parenthesized when the two operators would otherwise merge, as in `a - -b`
+    void operand(const std::string& op, const Expr& expr) {
+        if (expr.kind == Expr::Kind::Unary && op.back() == expr.text[0]) {
+            emit("(");
+            this->expr(expr);
+            emit(")");
+        }
+        else
+            this->expr(expr);
+    }
+
+    void expr(const Expr& expr) {
+        switch (expr.kind) {
+        case Expr::Kind::Name:
+            if (functions.count(expr.text))
+                // functions passed as values are wrapped so that overloads and concept parameters resolve where they are called
+                emit("[](const auto&... args) -> decltype(auto) {return " + expr.text + "(args...);}");
+            else if (namespaces.count(expr.text))
+                emit(scope(expr.text));
+            else if (expr.text == "str")
+                emit("cimple::str");
+            else
+                emit(expr.text);
+            break;
+        case Expr::Kind::Number:
+        case Expr::Kind::String:
+        case Expr::Kind::Char:
+            emit(expr.text);
+            break;
+        case Expr::Kind::Member: {
+            const Expr& object = *expr.items[0];
+            if (object.kind == Expr::Kind::Name && namespaces.count(object.text))
+                emit(scope(object.text) + "::" + expr.text);
+            else if (object.kind == Expr::Kind::Name && object.text == "self") {
+                emit(inConcept ? "self" : "this");
+                emit("->");
+                emit(expr.text);
             }
-            bool followedByParenthesis = lookahead < tokens.size() && (tokens[lookahead] == "(" || tokens[lookahead]==".");
-
-            if (isShared && followedByParenthesis) {
-                // It's a constructor call
-                templateName = "make_safe_shared";
-                isConstructorCall = true;
-            } else {
-                // Regular type usage
-                if (isShared)
-                    templateName = "SafeSharedPtr";
-                else
-                    templateName = "SafeVector";
+            else if (object.kind == Expr::Kind::Handler)
+                throw std::runtime_error("Use `" + object.type->name + "[type].new(...)` to construct handlers.");
+            else {
+                this->expr(object);
+                emit("->");
+                emit(expr.text);
             }
-
-            type += templateName + "<" + nestedType + ">";
+            break;
+        }
+        case Expr::Kind::Call: {
+            const Expr& callee = *expr.items[0];
+            if (callee.kind == Expr::Kind::Handler)
+                emit(constructor(*callee.type));
+            else if (callee.kind == Expr::Kind::Member && callee.items[0]->kind == Expr::Kind::Handler && callee.text == "new")
+                emit(constructor(*callee.items[0]->type));
+            else if (handlerMethod(expr))
+                throw std::runtime_error("Methods can only be called on newly constructed handlers to initialize variables, as in `var x = shared[vector[double]].reserve(100);`.");
+            else if (callee.kind == Expr::Kind::Name && pipelineFunctions.count(callee.text) && !functions.count(callee.text))
+                emit("cimple::" + callee.text);
+            else if (callee.kind == Expr::Kind::Name && callee.text == "table" && !functions.count(callee.text)) {
+                // the size is a template argument so that the table is a fixed array the compiler can fill
+                if (expr.items.size() != 3)
+                    throw std::runtime_error("Use `table(size, function)` to compute a table of function(0), ..., function(size-1).");
+                emit("cimple::table");
+                emit("<");
+                this->expr(*expr.items[1]);
+                emit(">");
+                emit("(");
+                this->expr(*expr.items[2]);
+                emit(")");
+                break;
+            }
+            else if (callee.kind == Expr::Kind::Name && (callee.text == "str" || callee.text == "keep" || callee.text == "format") && !functions.count(callee.text))
+                emit("cimple::" + callee.text);
+            else if (callee.kind == Expr::Kind::Name)
+                emit(callee.text);
+            else
+                this->expr(callee);
+            arguments(expr);
+            break;
         }
-        else if (current == "[") {
-            pos++; // Move past '['
-            std::string nestedType = parseType(tokens, pos, conceptNames, false, isConstructorCall, start_pos);
-            if (pos >= tokens.size() || tokens[pos] != "]") {
-                throw std::runtime_error("Expected ']' after '['");
+        case Expr::Kind::Index:
+            this->expr(*expr.items[0]);
+            emit("[");
+            this->expr(*expr.items[1]);
+            emit("]");
+            break;
+        case Expr::Kind::Unary:
+            emit(expr.text);
+            operand(expr.text, *expr.items[0]);
+            break;
+        case Expr::Kind::Postfix:
+            this->expr(*expr.items[0]);
+            emit(expr.text);
+            break;
+        case Expr::Kind::Binary:
+        case Expr::Kind::Assign:
+            this->expr(*expr.items[0]);
+            emit(expr.text);
+            operand(expr.text, *expr.items[1]);
+            break;
+        case Expr::Kind::Handler:
+            emit(type(*expr.type));
+            break;
+        case Expr::Kind::List: {
+            // kept in one token so that the layout does not break lines at the braces
+            std::vector<std::string> items;
+            out.swap(items);
+            for (size_t i = 0; i < expr.items.size(); ++i) {
+                if (i)
+                    emit(", ");
+                this->expr(*expr.items[i]);
+            }
+            out.swap(items);
+            std::string list = "{";
+            for (size_t i = 0; i < items.size(); ++i) {
+                if (i && std::isalnum(static_cast<unsigned char>(items[i - 1].back())) && std::isalnum(static_cast<unsigned char>(items[i][0])))
+                    list += ' ';
+                list += items[i];
             }
-            pos++; // Move past ']'
-            type += "[" + nestedType + "]";
+            emit(list + "}");
+            break;
         }
-        else if (current == ",") {
-            //pos++; // Move past ','
-            //type += ", ";
+        case Expr::Kind::Paren:
+            emit("(");
+            this->expr(*expr.items[0]);
+            emit(")");
+            break;
+        case Expr::Kind::Operator: {
+            static const std::unordered_map<std::string, std::string> functors = {
+                {"+", "plus"}, {"-", "minus"}, {"*", "multiplies"}, {"/", "divides"}, {"%", "modulus"},
+                {"==", "equal_to"}, {"!=", "not_equal_to"}, {"<", "less"}, {">", "greater"}, {"<=", "less_equal"}, {">=", "greater_equal"},
+                {"&&", "logical_and"}, {"and", "logical_and"}, {"||", "logical_or"}, {"or", "logical_or"}, {"|", "bit_or"}, {"^", "bit_xor"}};
+            auto functor = functors.find(expr.text);
+            if (functor == functors.end())
+                throw std::runtime_error("`" + expr.text + "` cannot be passed as a function.");
+            emit("std::" + functor->second + "<>()");
             break;
         }
-        else if (current == "]" || current == ")" || current == ";") {
-            // End of type
+        case Expr::Kind::Inline:
+            out.insert(out.end(), expr.raw.begin(), expr.raw.end());
             break;
         }
-        else if (current == "const" || current == "&" || current == "void") {
-            std::runtime_error("`"+current+"` are reserved for internal usage.");
+    }
+
+    // Statements that may also appear in the header of a for loop, without their `;`.
+    void simple(const Stmt& stmt) {
+        if (stmt.comptime) {
+            comptimeCheck->check(*stmt.value);
+            if (!comptime)
+                emit("static"); // computed once by the compiler and kept in read-only data
+            emit("constexpr");
+        }
+        if (stmt.kind == Stmt::Kind::Var) {
+            emit("auto");
+            emit(stmt.name);
+            if (stmt.value) {
+                emit("=");
+                expr(*stmt.value);
+            }
         }
-        else {
-            // Base type
-            // if (current == "string") 
-            //     current = "std::string";
-        
-            // If declaring and the type is a function argument, append '&' unless it's a primitive type
-            if (declaring && !isConstructorCall) {
-                if (primitiveTypes.find(type) == primitiveTypes.end()) {
-                    // Not a primitive type, convert to const Type&
-                    //type = "const " + type + "&";
-                    type = type + "&";
-                }
+        else if (stmt.kind == Stmt::Kind::Declare) {
+            emit(type(*stmt.type));
+            emit(stmt.name);
+            if (stmt.value) {
+                emit("=");
+                expr(*stmt.value);
             }
-            
-            if(current==".") {
-                isConstructorCall = false;
-                // we are just after a templated type, so do something according to the next token
-                if(pos<tokens.size()-1 && tokens[pos+1]=="new") {
-                    pos+=2; // also skip "new"
-                    continue; // just continue and take the arguments
+            else if (stmt.constructed) {
+                emit("(");
+                for (size_t i = 0; i < stmt.arguments.size(); ++i) {
+                    if (i)
+                        emit(",");
+                    expr(*stmt.arguments[i]);
                 }
-                pos++;
-                type += "(); "+tokens[start_pos]+"->";
-                return type;
+                emit(")");
             }
+        }
+        else if (stmt.kind == Stmt::Kind::Expr)
+            expr(*stmt.value);
+        else if (stmt.kind != Stmt::Kind::Empty)
+            throw std::runtime_error("Only declarations and expressions can start a for loop.");
+    }
 
-            type += current;
-            pos++;
+    void body(const Stmt& stmt) {
+        if (stmt.kind == Stmt::Kind::Block)
+            this->stmt(stmt);
+        else {
+            emit("{");
+            statement(stmt);
+            emit("}");
         }
+    }
 
-        // Handle multiple tokens for base types (e.g., 'unsigned int')
-        if (pos < tokens.size() && tokens[pos] == "int" && tokens[pos - 1] == "unsigned") {
-            type += " " + tokens[pos];
-            pos++;
+    // `file:line` of the token at `position`
+    std::string site(size_t position) const {
+        return module + ":" + (position < locations.size() ? std::to_string(locations[position].line) : "?");
+    }
+
+    // Lowers a statement of a block. In `--memstats` builds, statements that may create vectors or shared values
+    // first make their line the site that those are attributed to.
+    void statement(const Stmt& stmt) {
+        bool creates = stmt.kind == Stmt::Kind::Var || stmt.kind == Stmt::Kind::Declare || stmt.kind == Stmt::Kind::Expr || stmt.kind == Stmt::Kind::Return;
+        if (!memoryFunc.empty() && creates) {
+            emit("{");
+            emit("static cimple::memory::Site cimple_memory_line(\"" + escape(site(stmt.position)) + "\", \"" + escape(memoryFunc) + "\");");
+            emit("cimple::memory::current = &cimple_memory_line;");
+            emit("}");
         }
+        this->stmt(stmt);
     }
 
-    return type;
-}
+    void stmt(const Stmt& stmt) {
+        if (stmt.kind != Stmt::Kind::Block)
+            locate(stmt.position);
+        switch (stmt.kind) {
+        case Stmt::Kind::Block:
+            emit("{");
+            for (const StmtPtr& child : stmt.body)
+                statement(*child);
+            emit("}");
+            break;
+        case Stmt::Kind::Var:
+            if (!stmt.comptime && stmt.value && (handlerMethod(*stmt.value) || stackValues.count(stmt.name))) {
+                const Expr& call = *stmt.value;
+                const Expr& callee = call.items[0]->kind == Expr::Kind::Member ? *call.items[0]->items[0] : *call.items[0];
+                emit("auto");
+                emit(stmt.name);
+                emit("=");
+                // shared locals that never leave the function are plain values, which support the same `->` access
+                emit(stackValues.count(stmt.name) ? type(*callee.type->element) : constructor(*callee.type));
+                if (!handlerMethod(call)) {
+                    arguments(call);
+                    emit(";");
+                    break;
+                }
+                emit("(");
+                emit(")");
+                emit(";");
+                emit(stmt.name);
+                emit("->");
+                emit(call.items[0]->text);
+                arguments(call);
+                emit(";");
+                break;
+            }
+            simple(stmt);
+            emit(";");
+            break;
+        case Stmt::Kind::Expr:
+        case Stmt::Kind::Declare:
+        case Stmt::Kind::Empty:
+            simple(stmt);
+            emit(";");
+            break;
+        case Stmt::Kind::If:
+            emit("if");
+            emit("(");
+            expr(*stmt.value);
+            emit(")");
+            body(*stmt.body[0]);
+            if (stmt.body.size() > 1) {
+                emit("else");
+                if (stmt.body[1]->kind == Stmt::Kind::If)
+                    this->stmt(*stmt.body[1]);
+                else
+                    body(*stmt.body[1]);
+            }
+            break;
+        case Stmt::Kind::While:
+            emit("while");
+            emit("(");
+            expr(*stmt.value);
+            emit(")");
+            body(*stmt.body[0]);
+            break;
+        case Stmt::Kind::DoWhile:
+            emit("do");
+            body(*stmt.body[0]);
+            emit("while");
+            emit("(");
+            expr(*stmt.value);
+            emit(")");
+            emit(";");
+            break;
+        case Stmt::Kind::For:
+            emit("for");
+            emit("(");
+            simple(*stmt.init);
+            emit(";");
+            if (stmt.value)
+                expr(*stmt.value);
+            emit(";");
+            for (size_t i = 0; i < stmt.steps.size(); ++i) {
+                if (i)
+                    emit(",");
+                expr(*stmt.steps[i]);
+            }
+            emit(")");
+            body(*stmt.body[0]);
+            break;
+        case Stmt::Kind::ForIn: {
+            emit("for");
+            emit("(");
+            emit("auto");
+            if (stmt.binding)
+                emit("[");
+            for (size_t i = 0; i < stmt.names.size(); ++i) {
+                if (i)
+                    emit(",");
+                emit(stmt.names[i]);
+            }
+            if (stmt.binding)
+                emit("]");
+            emit(":");
+            emit("LockedIterable");
+            emit("(");
+            expr(*stmt.value);
+            emit(")");
+            emit(")");
+            body(*stmt.body[0]);
+            break;
+        }
+        case Stmt::Kind::Return:
+            if (generator && stmt.value)
+                throw std::runtime_error("Generators cannot return a value. Use `yield` instead.");
+            emit(generator ? "co_return" : "return");
+            if (stmt.value)
+                expr(*stmt.value);
+            emit(";");
+            break;
+        case Stmt::Kind::Yield:
+            if (!generator)
+                throw std::runtime_error("`yield` can only be used in `gen` functions.");
+            emit("co_yield");
+            expr(*stmt.value);
+            emit(";");
+            break;
+        case Stmt::Kind::Break:
+            emit("break");
+            emit(";");
+            break;
+        case Stmt::Kind::Continue:
+            emit("continue");
+            emit(";");
+            break;
+        case Stmt::Kind::Try:
+            emit("try");
+            this->stmt(*stmt.body[0]);
+            for (size_t i = 0; i < stmt.catches.size(); ++i) {
+                emit("catch");
+                emit("(");
+                out.insert(out.end(), stmt.catches[i].begin(), stmt.catches[i].end());
+                emit(")");
+                this->stmt(*stmt.body[i + 1]);
+            }
+            break;
+        case Stmt::Kind::Unbind:
+            expr(*stmt.value);
+            emit(".");
+            emit("unbind()");
+            emit(";");
+            break;
+        case Stmt::Kind::Inline:
+            out.insert(out.end(), stmt.raw.begin(), stmt.raw.end());
+            emit(";");
+            break;
+        }
+    }
+
+    void func(const Func& func, bool method) {
+        locate(func.position);
+        if (func.comptime) {
+            comptimeCheck->check(func);
+            emit("constexpr");
+        }
+        if (func.declared) {
+            emit(func.name == "main" && !method ? "int" : "auto");
+            emit(func.name);
+        }
+        else if (func.constructor)
+            emit(func.name);
+        else if (func.generator) {
+            emit("cimple::Generator<" + type(*func.result) + ">");
+            emit(func.name);
+        }
+        else {
+            emit(type(*func.result));
+            emit(func.name);
+        }
+        emit("(");
+        for (size_t i = 0; i < func.params.size(); ++i) {
+            const Param& param = func.params[i];
+            if (i)
+                emit(",");
+            if (concepts.count(param.type.name)) {
+                emit("const");
+                emit(param.type.name);
+                emit("auto");
+                emit("&");
+            }
+            else if (primitiveTypes.count(param.type.name))
+                emit(type(param.type));
+            else if (!mutations->readOnly(func, i))
+                emit(type(param.type) + "&");
+            else if (func.generator && !mutations->smallValue(param.type))
+                emit(type(param.type) + "&"); // generators outlive the call, so they must not keep references to temporaries
+            else {
+                // read-only arguments also bind to temporaries, and small structs are copied into registers instead
+                emit("const");
+                emit(mutations->smallValue(param.type) ? type(param.type) : type(param.type) + "&");
+            }
+            emit(param.name);
+        }
+        emit(")");
+        if (method && !func.constructor && mutations->constMethod(func))
+            emit("const");
+        emit("{");
+        if (program && benchmarks && !method && func.name == "main") {
+            // `cimple bench` runs the same executable with CIMPLE_BENCH set
+            emit("if (cimple::bench::requested()) return cimple::bench::run();\n");
+        }
+        if (profiling && !func.comptime && !func.generator) {
+            // generators are left out, since their calls suspend instead of returning
+            std::string name = method ? structure + "." + func.name : func.name;
+            emit("static cimple::profile::Site cimple_profile_site(\"" + escape(module) + "\", \"" + escape(name) + "\");");
+            emit("cimple::profile::Scope cimple_profile_scope(cimple_profile_site);");
+        }
+        if (memoryStats && !func.comptime && !func.generator) {
+            // generators are left out, since they suspend without restoring the line of their caller
+            memoryFunc = module + ": " + (method ? structure + "." + func.name : func.name);
+            emit("static cimple::memory::Site cimple_memory_site(\"" + escape(site(func.position)) + "\", \"" + escape(memoryFunc) + "\");");
+            emit("cimple::memory::Frame cimple_memory_frame(cimple_memory_site);");
+        }
+        stackValues = stackLocals(func);
+        generator = func.generator;
+        comptime = func.comptime;
+        for (const StmtPtr& stmt : func.body)
+            statement(*stmt);
+        memoryFunc.clear();
+        if (generator) {
+            emit("co_return"); // keeps generators that never yield coroutines
+            emit(";");
+        }
+        generator = false;
+        comptime = false;
+        stackValues.clear();
+        emit("}");
+    }
 
-std::vector<std::string> transformTokens(const std::vector<std::string>& tokens, bool injectExtras, std::vector<std::string>& preample, const std::string &transpilation_depth, const std::string &directory) {
+    void lower(const Decl& decl) {
+        if (decl.kind != Decl::Kind::Include && decl.kind != Decl::Kind::Get)
+            locate(decl.position);
+        switch (decl.kind) {
+        case Decl::Kind::Func:
+            func(*decl.func, false);
+            break;
+        case Decl::Kind::Struct:
+            emit("struct");
+            emit(decl.name);
+            emit("{");
+            structure = decl.name;
+            emit(decl.name+"* operator->() {return this;} // optimized away by -O2 \n");
+            emit("const "+decl.name+"* operator->() const {return this;} // optimized away by -O2 \n");
+            emit(decl.name+"(const "+decl.name+"& other) = default; \n");
+            emit(decl.name+"("+decl.name+"&& other) = default; \n");
+            for (const Member& member : decl.members) {
+                if (member.method)
+                    func(*member.method, true);
+                else
+                    stmt(*member.field);
+            }
+            emit("};");
+            break;
+        case Decl::Kind::Concept:
+            emit("template");
+            emit("<");
+            emit("typename T");
+            emit(">");
+            emit("concept");
+            emit(decl.name);
+            emit("=");
+            emit("requires");
+            emit("(");
+            emit("T");
+            emit("self");
+            emit(")");
+            emit("{");
+            inConcept = true;
+            for (const Requirement& requirement : decl.requirements) {
+                if (requirement.type) {
+                    emit("{ ");
+                    expr(*requirement.value);
+                    emit(" }");
+                    emit("->");
+                    emit("std::convertible_to");
+                    emit("<");
+                    emit(type(*requirement.type));
+                    emit(">");
+                }
+                else
+                    expr(*requirement.value);
+                emit(";");
+            }
+            inConcept = false;
+            emit("};");
+            break;
+        case Decl::Kind::Import: {
+            emit("\nnamespace");
+            emit(scope(decl.name));
+            emit("{");
+            std::cout << depth <<  "→ " << decl.path << ".cm" << std::endl;
+            std::vector<std::string> fileTokens;
+            std::vector<Location> fileLocations;
+            std::string filename = decl.path + ".cm";
+            size_t loaded = loadedFiles.size();
+            if (!loadTokens(filename, fileTokens, fileLocations)) {
+                filename = directory + "/" + decl.path + ".cm";
+                bool found = loadTokens(filename, fileTokens, fileLocations);
+                if (!found && decl.path.rfind("std/", 0) == 0) { // standard modules are also found where cimple is installed
+                    filename = installDirectory() + "/" + decl.path + ".cm";
+                    found = loadTokens(filename, fileTokens, fileLocations);
+                }
+                if (!found)
+                    throw std::runtime_error("Could not open file: " + filename);
+            }
+            // only the declarations reachable from the names used here are lowered
+            const std::unordered_set<std::string>& used = reachable.uses().at(decl.name);
+            std::vector<std::string> names(used.begin(), used.end());
+            std::sort(names.begin(), names.end());
+            // the name as written also goes into #line directives, so it is part of the key
+            std::string key = loadedFiles.back() + "\n" + filename;
+            for (const std::string& name : names)
+                key += "\n" + name;
+            auto lowered = loweredModules.find(key);
+            bool reusable = lowered != loweredModules.end() && lowered->second.profiling == profiling && lowered->second.memoryStats == memoryStats;
+            for (size_t i = 0; reusable && i < lowered->second.files.size(); ++i)
+                reusable = fileStamp(lowered->second.files[i]) == lowered->second.stamps[i];
+            if (reusable) {
+                fileTokens = lowered->second.tokens;
+                preample.insert(preample.end(), lowered->second.preample.begin(), lowered->second.preample.end());
+                loadedFiles.insert(loadedFiles.end(), lowered->second.files.begin() + 1, lowered->second.files.end());
+            }
+            else {
+                size_t included = preample.size();
+                size_t slash = decl.path.find_last_of('/');
+                std::string newDirectory = slash == std::string::npos ? directory : directory + "/" + decl.path.substr(0, slash);
+                fileTokens = transformTokens(fileTokens, fileLocations, false, preample, depth+"  ", newDirectory, filename, &used);
+                std::vector<std::string> files(loadedFiles.begin() + loaded, loadedFiles.end());
+                std::vector<std::string> stamps;
+                for (const std::string& file : files)
+                    stamps.push_back(fileStamp(file));
+                loweredModules[key] = LoweredModule{fileTokens, std::vector<std::string>(preample.begin() + included, preample.end()),
+                                                    files, stamps, profiling, memoryStats};
+            }
+            out.insert(out.end(), fileTokens.begin(), fileTokens.end());
+            namespaces.insert(decl.name);
+            emit("}");
+            emit("\n");
+            line = 0; // the imported module's directives came last
+            break;
+        }
+        case Decl::Kind::Include:
+            if (decl.path[0]=='"')
+                preample.emplace_back("#include "+decl.path+"\n");
+            else
+                preample.emplace_back("#include <"+decl.path+">\n");
+            break;
+        case Decl::Kind::Get:
+            packages.require(decl.path, decl.url);
+            break;
+        case Decl::Kind::Bench: {
+            // the block is one iteration, inlined into the loop that `cimple bench` times
+            std::string name = "cimple_bench_" + std::to_string(benchmark++);
+            emit("static void " + name + "(size_t iterations)");
+            emit("{");
+            emit("auto body = []()");
+            emit("{");
+            stackValues = stackLocals(*decl.func);
+            for (const StmtPtr& stmt : decl.func->body)
+                this->stmt(*stmt);
+            stackValues.clear();
+            emit("};");
+            emit("for (size_t i = 0; i < iterations; ++i) body();");
+            emit("}");
+            emit("static const bool " + name + "_added = cimple::bench::add(" + decl.name + ", " + name + ");");
+            break;
+        }
+        case Decl::Kind::Statement:
+            stmt(*decl.statement);
+            break;
+        }
+    }
+};
+
+std::vector<std::string> transformTokens(const std::vector<std::string>& tokens, const std::vector<Location>& locations, bool injectExtras, std::vector<std::string>& preample, const std::string &transpilation_depth, const std::string &directory, const std::string &filename,
+                                         const std::unordered_set<std::string>* used) {
     std::vector<std::string> newTokens;
     if(injectExtras)
-        newTokens.emplace_back("#include<atomic>\n#include <ranges>\n#include <iostream>\n#include <vector>\n#include <memory>\n#include <string>\n#define print(message) std::cout<<(message)<<std::endl\n");
-    std::string fnName("");
-    bool declaring = false;
-    bool inConcept = false;
-    std::unordered_set<std::string> argNames;
-    std::unordered_set<std::string> conceptNames;
-    std::unordered_set<std::string> namespaces;
-    namespaces.insert("cimple");
+        newTokens.emplace_back("#include<atomic>\n#include <ranges>\n#include <iostream>\n#include <vector>\n#include <memory>\n#include <string>\n#include <string_view>\n#include <sstream>\n#include <charconv>\n#include <cstring>\n#include <csignal>\n#include <exception>\n#include <type_traits>\n#include <stdexcept>\n#include <cerrno>\n#include <cstdlib>\n#include <unistd.h>\n");
+
+    // buffered output: print appends to a per-thread buffer that is written on flush(), when full, at exit, or on a crash
+    if(injectExtras)
+    newTokens.emplace_back(
+        "\n"
+        "namespace cimple {\n"
+        "class Output {\n"
+        "public:\n"
+        "    static constexpr size_t capacity = 1 << 16;\n"
+        "    Output() {\n"
+        "        for (std::atomic<Output*>& entry : all) {\n"
+        "            Output* none = nullptr;\n"
+        "            if (entry.compare_exchange_strong(none, this)) break;\n"
+        "        }\n"
+        "    }\n"
+        "    ~Output() {\n"
+        "        flush();\n"
+        "        for (std::atomic<Output*>& entry : all) {\n"
+        "            Output* self = this;\n"
+        "            if (entry.compare_exchange_strong(self, nullptr)) break;\n"
+        "        }\n"
+        "    }\n"
+        "    // writes the buffers of all threads when the program crashes; the other threads are not stopped, so a line that\n"
+        "    // one of them is printing at that moment may be cut or repeated\n"
+        "    static void flush_all() {\n"
+        "        for (std::atomic<Output*>& entry : all)\n"
+        "            if (Output* output = entry.load()) output->flush();\n"
+        "    }\n"
+        "    void flush() {\n"
+        "        size_t written = 0;\n"
+        "        while (written < size) {\n"
+        "            ssize_t n = ::write(1, data + written, size - written);\n"
+        "            if (n < 0 && errno == EINTR) continue;\n"
+        "            if (n <= 0) failed();\n"
+        "            written += n;\n"
+        "        }\n"
+        "        size = 0;\n"
+        "    }\n"
+        "    void write(const char* text, size_t length) {\n"
+        "        if (size + length > capacity) {\n"
+        "            flush();\n"
+        "            if (length > capacity) {\n"
+        "                while (length) {\n"
+        "                    ssize_t n = ::write(1, text, length);\n"
+        "                    if (n < 0 && errno == EINTR) continue;\n"
+        "                    if (n <= 0) failed();\n"
+        "                    text += n;\n"
+        "                    length -= n;\n"
+        "                }\n"
+        "                return;\n"
+        "            }\n"
+        "        }\n"
+        "        std::memcpy(data + size, text, length);\n"
+        "        size += length;\n"
+        "    }\n"
+        "    void endline() {\n"
+        "        if (size == capacity) flush();\n"
+        "        data[size++] = '\\n';\n"
+        "        if (line_buffered()) flush();\n"
+        "    }\n"
+        "private:\n"
+        "    // output that cannot be written stops the program, as a closed pipe does when SIGPIPE is not ignored\n"
+        "    [[noreturn]] static void failed() {\n"
+        "        if (errno == EPIPE) { std::signal(SIGPIPE, SIG_DFL); std::raise(SIGPIPE); }\n"
+        "        static const char message[] = \"Could not write the output of the program.\\n\";\n"
+        "        ssize_t ignored = ::write(2, message, sizeof(message) - 1);\n"
+        "        (void)ignored;\n"
+        "        std::_Exit(1);\n"
+        "    }\n"
+        "    static bool line_buffered() {\n"
+        "        static const bool tty = ::isatty(1);\n"
+        "        return tty;\n"
+        "    }\n"
+        "    char data[capacity];\n"
+        "    size_t size = 0;\n"
+        "    // the buffers of running threads, kept in a fixed table that signal handlers can walk without locking;\n"
+        "    // threads beyond its size still write their buffer when full, on flush() and when they exit\n"
+        "    static inline std::atomic<Output*> all[256] = {};\n"
+        "};\n"
+        "inline thread_local Output out;\n"
+        "\n"
+        "struct StringSink {\n"
+        "    std::string& text;\n"
+        "    void write(const char* chars, size_t length) { text.append(chars, length); }\n"
+        "};\n"
+        "\n"
+        "template <typename Sink, typename T>\n"
+        "void emit(Sink& sink, const T& value) {\n"
+        "    if constexpr (std::is_same_v<T, bool>)\n"
+        "        sink.write(value ? \"1\" : \"0\", 1);\n"
+        "    else if constexpr (std::is_same_v<T, char>)\n"
+        "        sink.write(&value, 1);\n"
+        "    else if constexpr (std::is_arithmetic_v<T>) {\n"
+        "        char chars[64];\n"
+        "        std::to_chars_result result;\n"
+        "        if constexpr (std::is_floating_point_v<T>)\n"
+        "            result = std::to_chars(chars, chars + sizeof(chars), value, std::chars_format::general, 6);\n"
+        "        else\n"
+        "            result = std::to_chars(chars, chars + sizeof(chars), value);\n"
+        "        sink.write(chars, result.ptr - chars);\n"
+        "    }\n"
+        "    else if constexpr (std::is_convertible_v<const T&, std::string_view>) {\n"
+        "        std::string_view view(value);\n"
+        "        sink.write(view.data(), view.size());\n"
+        "    }\n"
+        "    else {\n"
+        "        std::ostringstream stream;\n"
+        "        stream << value;\n"
+        "        std::string text = stream.str();\n"
+        "        sink.write(text.data(), text.size());\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "template <typename T>\n"
+        "void print(const T& value) { emit(out, value); out.endline(); }\n"
+        "inline void flush() { out.flush(); }\n"
+        "\n"
+        "template <typename T>\n"
+        "std::string string(const T& value) {\n"
+        "    if constexpr (std::is_floating_point_v<T>) {\n"
+        "        char chars[512];\n"
+        "        auto result = std::to_chars(chars, chars + sizeof(chars), value, std::chars_format::fixed, 6);\n"
+        "        return std::string(chars, result.ptr - chars);\n"
+        "    }\n"
+        "    else {\n"
+        "        std::string text;\n"
+        "        StringSink sink{text};\n"
+        "        emit(sink, value);\n"
+        "        return text;\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "inline void format_into(std::string& text, std::string_view pattern) {\n"
+        "    for (size_t i = 0; i < pattern.size(); ++i) {\n"
+        "        if (pattern[i] == '{' && i + 1 < pattern.size() && pattern[i + 1] == '}') throw std::runtime_error(\"More `{}` placeholders than arguments in `format`\");\n"
+        "        if ((pattern[i] == '{' || pattern[i] == '}') && i + 1 < pattern.size() && pattern[i + 1] == pattern[i]) ++i;\n"
+        "        else if (pattern[i] == '{' || pattern[i] == '}') throw std::runtime_error(\"Unmatched brace in `format`\");\n"
+        "        text += pattern[i];\n"
+        "    }\n"
+        "}\n"
+        "template <typename T, typename... Args>\n"
+        "void format_into(std::string& text, std::string_view pattern, const T& value, const Args&... args) {\n"
+        "    for (size_t i = 0; i < pattern.size(); ++i) {\n"
+        "        if (pattern[i] == '{' && i + 1 < pattern.size() && pattern[i + 1] == '}') {\n"
+        "            StringSink sink{text};\n"
+        "            emit(sink, value);\n"
+        "            format_into(text, pattern.substr(i + 2), args...);\n"
+        "            return;\n"
+        "        }\n"
+        "        if ((pattern[i] == '{' || pattern[i] == '}') && i + 1 < pattern.size() && pattern[i + 1] == pattern[i]) ++i;\n"
+        "        else if (pattern[i] == '{' || pattern[i] == '}') throw std::runtime_error(\"Unmatched brace in `format`\");\n"
+        "        text += pattern[i];\n"
+        "    }\n"
+        "    throw std::runtime_error(\"More arguments than `{}` placeholders in `format`\");\n"
+        "}\n"
+        "template <typename... Args>\n"
+        "std::string format(std::string_view pattern, const Args&... args) {\n"
+        "    std::string text;\n"
+        "    text.reserve(pattern.size() + 16 * sizeof...(args));\n"
+        "    format_into(text, pattern, args...);\n"
+        "    return text;\n"
+        "}\n"
+        "\n"
+        "inline void flush_on_signal(int signal) { Output::flush_all(); std::signal(signal, SIG_DFL); std::raise(signal); }\n"
+        "inline std::terminate_handler previous_terminate = nullptr;\n"
+        "inline const bool output_installed = [] {\n"
+        "    for (int signal : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM, SIGINT})\n"
+        "        std::signal(signal, flush_on_signal);\n"
+        "    previous_terminate = std::set_terminate([] { Output::flush_all(); if (previous_terminate) previous_terminate(); std::abort(); });\n"
+        "    return true;\n"
+        "}();\n"
+        "}\n"
+        "\n"
+    );
     if(injectExtras)
-        newTokens.emplace_back("\n#define string(message) std::to_string(message)\n");
+        newTokens.emplace_back("\n#define print(message) ::cimple::print(message)\n#define string(message) ::cimple::string(message)\nusing ::cimple::flush;\n");
     
+    // `--memstats` accounting of the memory of vectors and shared values, attributed to the line that created them
+    if(injectExtras && memoryStats)
+    newTokens.emplace_back(
+        "\n#include <typeinfo>\n#include <cxxabi.h>\n#include <deque>\n#include <mutex>\n#include <cstdio>\n#include <cstdlib>\n#include <cstring>\n#include <algorithm>\n"
+        "namespace cimple::memory {\n"
+        "inline constexpr bool enabled = true;\n"
+        "// Allocations of one kind of handler for one type, made at one site\n"
+        "struct Stats {\n"
+        "    const char* site;\n"
+        "    const char* func;\n"
+        "    const char* kind;\n"
+        "    const char* type; // mangled name of the element type\n"
+        "    std::atomic<size_t> allocations{0}, reallocations{0}, bytes{0}, live{0}, peak{0};\n"
+        "    Stats(const char* site, const char* func, const char* kind, const char* type) : site(site), func(func), kind(kind), type(type) {}\n"
+        "};\n"
+        "// A line of the program, named file:line, to which the handlers created by its statement are attributed.\n"
+        "// Each func also has a site at its own line for what it creates before its first statement.\n"
+        "struct Site {\n"
+        "    const char* name;\n"
+        "    const char* func;\n"
+        "    std::vector<Stats*> stats;\n"
+        "    Site(const char* name, const char* func) : name(name), func(func) {}\n"
+        "};\n"
+        "struct Registry {\n"
+        "    std::mutex mutex;\n"
+        "    std::deque<Stats> stats;\n"
+        "    std::atomic<size_t> live{0}, peak{0};\n"
+        "};\n"
+        "// never destroyed, so that allocations may still be freed while the report is printed\n"
+        "inline Registry& registry() {\n"
+        "    static Registry* registry = new Registry();\n"
+        "    return *registry;\n"
+        "}\n"
+        "inline Site outside(\"(outside funcs)\", \"(outside funcs)\");\n"
+        "inline thread_local Site* current = nullptr;\n"
+        "// Attributes handlers to the site of the func until its first statement, and restores the caller's line when it returns\n"
+        "class Frame {\n"
+        "    Site* previous;\n"
+        "public:\n"
+        "    explicit Frame(Site& site) : previous(current) { current = &site; }\n"
+        "    ~Frame() { current = previous; }\n"
+        "};\n"
+        "inline void grow(std::atomic<size_t>& live, std::atomic<size_t>& peak, size_t bytes) {\n"
+        "    size_t now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;\n"
+        "    size_t previous = peak.load(std::memory_order_relaxed);\n"
+        "    while (now > previous && !peak.compare_exchange_weak(previous, now, std::memory_order_relaxed)) {}\n"
+        "}\n"
+        "\n"
+        "inline void report() {\n"
+        "    Registry& all = registry();\n"
+        "    std::lock_guard<std::mutex> lock(all.mutex);\n"
+        "    std::vector<const Stats*> order;\n"
+        "    for (const Stats& stats : all.stats)\n"
+        "        order.push_back(&stats);\n"
+        "    std::sort(order.begin(), order.end(), [](const Stats* a, const Stats* b) { return a->bytes > b->bytes; });\n"
+        "    std::fprintf(stderr, \"---------------- Memory --------------------\\n\");\n"
+        "    std::fprintf(stderr, \"%-30s %-24s %12s %12s %14s %14s %14s\\n\", \"site\", \"type\", \"allocations\", \"reallocs\", \"bytes\", \"peak live\", \"live\");\n"
+        "    std::vector<std::pair<const char*, Stats*>> funcs; // totals of each func, without peaks since those of its sites need not coincide\n"
+        "    std::deque<Stats> totals;\n"
+        "    for (const Stats* stats : order) {\n"
+        "        auto found = std::find_if(funcs.begin(), funcs.end(), [&](const auto& func) { return !std::strcmp(func.first, stats->func); });\n"
+        "        if (found == funcs.end())\n"
+        "            found = funcs.insert(funcs.end(), {stats->func, &totals.emplace_back(stats->func, stats->func, \"\", \"\")});\n"
+        "        found->second->allocations += stats->allocations.load();\n"
+        "        found->second->reallocations += stats->reallocations.load();\n"
+        "        found->second->bytes += stats->bytes.load();\n"
+        "        found->second->live += stats->live.load();\n"
+        "        int status = 0;\n"
+        "        char* demangled = abi::__cxa_demangle(stats->type, nullptr, nullptr, &status);\n"
+        "        char type[256];\n"
+        "        std::snprintf(type, sizeof(type), \"%s[%s]\", stats->kind, status == 0 ? demangled : stats->type);\n"
+        "        std::free(demangled);\n"
+        "        std::fprintf(stderr, \"%-30s %-24s %12zu %12zu %14zu %14zu %14zu\\n\", stats->site, type, stats->allocations.load(), stats->reallocations.load(),\n"
+        "                     stats->bytes.load(), stats->peak.load(), stats->live.load());\n"
+        "    }\n"
+        "    std::fprintf(stderr, \"%-30s %-24s %12s %12s %14s %14zu %14zu\\n\", \"all\", \"\", \"\", \"\", \"\", all.peak.load(), all.live.load());\n"
+        "    std::fprintf(stderr, \"%-55s %12s %12s %14s %14s %14s\\n\", \"func\", \"allocations\", \"reallocs\", \"bytes\", \"\", \"live\");\n"
+        "    for (const auto& [name, stats] : funcs)\n"
+        "        std::fprintf(stderr, \"%-55s %12zu %12zu %14zu %14s %14zu\\n\", name, stats->allocations.load(), stats->reallocations.load(),\n"
+        "                     stats->bytes.load(), \"\", stats->live.load());\n"
+        "}\n"
+        "\n"
+        "// Finds the stats of the current site for handlers of `kind` over the `type` that typeid names\n"
+        "inline Stats* account(const char* kind, const char* type) {\n"
+        "    Site& site = current ? *current : outside;\n"
+        "    Registry& all = registry();\n"
+        "    std::lock_guard<std::mutex> lock(all.mutex);\n"
+        "    for (Stats* stats : site.stats)\n"
+        "        if (stats->kind == kind && !std::strcmp(stats->type, type))\n"
+        "            return stats;\n"
+        "    if (all.stats.empty())\n"
+        "        std::atexit(report);\n"
+        "    site.stats.push_back(&all.stats.emplace_back(site.name, site.func, kind, type));\n"
+        "    return site.stats.back();\n"
+        "}\n"
+        "\n"
+        "// Counts the memory of vectors and shared values, attributed to the line that created them\n"
+        "template <typename T>\n"
+        "struct Allocator {\n"
+        "    using value_type = T;\n"
+        "    using propagate_on_container_move_assignment = std::true_type;\n"
+        "    Stats* stats;\n"
+        "    size_t blocks = 0; // blocks held, so that allocating while holding one is a reallocation, such as when `push` grows a vector\n"
+        "    explicit Allocator(const char* kind = \"vector\") : stats(account(kind, typeid(T).name())) {}\n"
+        "    template <typename U>\n"
+        "    Allocator(const Allocator<U>& other) : stats(other.stats) {}\n"
+        "    Allocator(const Allocator& other) : stats(other.stats) {}\n"
+        "    Allocator(Allocator&& other) : stats(other.stats), blocks(other.blocks) { other.blocks = 0; }\n"
+        "    Allocator& operator=(const Allocator& other) { stats = other.stats; return *this; }\n"
+        "    Allocator& operator=(Allocator&& other) { stats = other.stats; blocks = other.blocks; other.blocks = 0; return *this; }\n"
+        "    T* allocate(size_t n) {\n"
+        "        stats->allocations.fetch_add(1, std::memory_order_relaxed);\n"
+        "        if (blocks++)\n"
+        "            stats->reallocations.fetch_add(1, std::memory_order_relaxed);\n"
+        "        stats->bytes.fetch_add(n * sizeof(T), std::memory_order_relaxed);\n"
+        "        grow(stats->live, stats->peak, n * sizeof(T));\n"
+        "        grow(registry().live, registry().peak, n * sizeof(T));\n"
+        "        return std::allocator<T>().allocate(n);\n"
+        "    }\n"
+        "    void deallocate(T* pointer, size_t n) {\n"
+        "        if (blocks)\n"
+        "            --blocks;\n"
+        "        stats->live.fetch_sub(n * sizeof(T), std::memory_order_relaxed);\n"
+        "        registry().live.fetch_sub(n * sizeof(T), std::memory_order_relaxed);\n"
+        "        std::allocator<T>().deallocate(pointer, n);\n"
+        "    }\n"
+        "    template <typename U>\n"
+        "    bool operator==(const Allocator<U>&) const { return true; }\n"
+        "};\n"
+        "}\n"
+        "namespace cimple {\n"
+        "// `cimple.memstats()` prints the allocations so far\n"
+        "inline void memstats() {\n"
+        "    flush();\n"
+        "    memory::report();\n"
+        "}\n"
+        "}\n\n"
+    );
+    else if(injectExtras)
+    newTokens.emplace_back(
+        "\n#include <cstdio>\n"
+        "namespace cimple::memory {\n"
+        "inline constexpr bool enabled = false;\n"
+        "template <typename T>\n"
+        "using Allocator = std::allocator<T>;\n"
+        "}\n"
+        "namespace cimple {\n"
+        "inline void memstats() {\n"
+        "    flush();\n"
+        "    std::fprintf(stderr, \"Build with --memstats to count allocations.\\n\");\n"
+        "}\n"
+        "}\n\n"
+    );
+
     if(injectExtras)
     newTokens.emplace_back(
         "\n#include <stdexcept>\n"
@@ -247,7 +1284,10 @@ std::vector<std::string> transformTokens(const std::vector<std::string>& tokens,
         "};\n\n"
         "template <typename T, typename... Args>\n"
         "SafeSharedPtr<T> make_safe_shared(Args&&... args) {\n"
-        "    return SafeSharedPtr<T>(std::make_shared<T>(std::forward<Args>(args)...));\n"
+        "    if constexpr (cimple::memory::enabled)\n"
+        "        return SafeSharedPtr<T>(std::allocate_shared<T>(cimple::memory::Allocator<T>(\"shared\"), std::forward<Args>(args)...));\n"
+        "    else\n"
+        "        return SafeSharedPtr<T>(std::make_shared<T>(std::forward<Args>(args)...));\n"
         "}\n"
         "\n"
     );
@@ -255,63 +1295,777 @@ std::vector<std::string> transformTokens(const std::vector<std::string>& tokens,
 
     if(injectExtras)
     newTokens.emplace_back(
+        "// locks a container while a loop goes through it; temporaries, such as generators, are kept alive by being moved in\n"
         "template <typename Iterable>\n"
         "class LockedIterable {\n"
         "private:\n"
-        "    Iterable& m_iterable;\n"
+        "    Iterable m_iterable;\n"
         "public:\n"
-        "    Iterable& get() {return m_iterable;}\n"
-        "    LockedIterable(Iterable& iterable) : m_iterable(iterable) {m_iterable->lock();}\n"
+        "    std::remove_reference_t<Iterable>& get() {return m_iterable;}\n"
+        "    LockedIterable(Iterable&& iterable) : m_iterable(std::forward<Iterable>(iterable)) {m_iterable->lock();}\n"
         "    ~LockedIterable() {m_iterable->unlock();}\n"
         "    LockedIterable(const LockedIterable&) = delete;\n"
         "    LockedIterable& operator=(const LockedIterable&) = delete;\n"
-        "    LockedIterable(LockedIterable&& other) noexcept : m_iterable(other.m_iterable) {other.m_iterable = nullptr;}\n"
-        "    LockedIterable& operator=(LockedIterable&& other) noexcept {\n"
-        "        if (this != &other) {m_iterable->unlock();m_iterable = other.m_iterable;other.m_iterable = nullptr;}\n"
-        "        return *this;\n"
-        "    }\n"
-        "    auto begin() const { return m_iterable->begin(); }\n"
-        "    auto end() const { return m_iterable->end(); }\n"
-        "};\n\n"
+        "    auto begin() { return m_iterable->begin(); }\n"
+        "    auto end() { return m_iterable->end(); }\n"
+        "};\n"
+        "template <typename Iterable>\n"
+        "LockedIterable(Iterable&&) -> LockedIterable<Iterable>;\n\n"
     );
 
+    // generators of `gen` functions, which run up to each `yield` as loops ask for the next value
     if(injectExtras)
     newTokens.emplace_back(
+        "\n#include <coroutine>\n#include <utility>\n"
+        "namespace cimple {\n"
+        "// one freed coroutine frame per thread is kept for the next generator, as loops often create a generator per iteration\n"
+        "struct FrameCache {\n"
+        "    void* frame = nullptr;\n"
+        "    size_t size = 0;\n"
+        "    ~FrameCache() { ::operator delete(frame); }\n"
+        "};\n"
+        "inline thread_local FrameCache frameCache;\n"
         "template <typename T>\n"
-        "class SafeVector {\n"
-        "private:\n"
-        "    std::vector<T> data;\n"
-        "    std::atomic<int> itercount;\n"
-        "\n"
+        "class Generator {\n"
         "public:\n"
-        "    SafeVector() = default;\n"
-        "    SafeVector(int size) : data(size), itercount(0) {}\n"
-        "    SafeVector(std::initializer_list<T> init) : data(init), itercount(0) {}\n"
-        "    SafeVector(const SafeVector& other) = delete;\n"
-        "    SafeVector(SafeVector<T>&& other) : data(std::move(other.data)), itercount(0) {if(other.itercount) throw std::out_of_range(\"Cannot return a vector from within a loop.\");}\n"
-        "    operator auto() const {return data.begin();} \n"
-        "    auto lock() { ++itercount; }\n"
-        "    auto unlock() { --itercount; }\n"
-        "    auto begin() const { return data.begin(); }\n"
-        "    auto end() const { return data.end(); }\n"
-        "    size_t size() const { return data.size(); }\n"
-        "    SafeVector* operator->() {return this;} // optimized away by -O2 \n"
-        "    const SafeVector* operator->() const {return this;} // optimized away by -O2 \n"
-        "    T& operator[](size_t index) {\n"
-        "        if (index >= data.size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `vector` with \"+std::to_string(data.size())+\" elements\");\n"
-        "        return data[index];\n"
+        "    struct promise_type {\n"
+        "        const T* current = nullptr; // the yielded value lives until the generator resumes\n"
+        "        std::exception_ptr error;\n"
+        "        Generator get_return_object() { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }\n"
+        "        std::suspend_always initial_suspend() noexcept { return {}; }\n"
+        "        std::suspend_always final_suspend() noexcept { return {}; }\n"
+        "        std::suspend_always yield_value(const T& value) noexcept { current = std::addressof(value); return {}; }\n"
+        "        void return_void() noexcept {}\n"
+        "        void unhandled_exception() { error = std::current_exception(); }\n"
+        "        static void* operator new(size_t size) {\n"
+        "            if (frameCache.frame && frameCache.size == size) { void* frame = frameCache.frame; frameCache.frame = nullptr; return frame; }\n"
+        "            return ::operator new(size);\n"
+        "        }\n"
+        "        static void operator delete(void* frame, size_t size) {\n"
+        "            if (!frameCache.frame) { frameCache.frame = frame; frameCache.size = size; return; }\n"
+        "            ::operator delete(frame);\n"
+        "        }\n"
+        "    };\n"
+        "    class iterator {\n"
+        "    private:\n"
+        "        std::coroutine_handle<promise_type> handle;\n"
+        "    public:\n"
+        "        explicit iterator(std::coroutine_handle<promise_type> handle) : handle(handle) {}\n"
+        "        const T& operator*() const { return *handle.promise().current; }\n"
+        "        iterator& operator++() { Generator::resume(handle); return *this; }\n"
+        "        bool operator!=(std::default_sentinel_t) const { return !handle.done(); }\n"
+        "    };\n"
+        "    explicit Generator(std::coroutine_handle<promise_type> handle) : handle(handle) {}\n"
+        "    Generator(Generator&& other) noexcept : handle(other.handle), iterating(other.iterating) { other.handle = nullptr; }\n"
+        "    Generator(const Generator&) = delete;\n"
+        "    ~Generator() { if (handle) handle.destroy(); }\n"
+        "    Generator* operator->() {return this;} // optimized away by -O2 \n"
+        "    void lock() { if (iterating) throw std::runtime_error(\"Cannot iterate through the same generator twice at once.\"); iterating = true; }\n"
+        "    void unlock() { iterating = false; }\n"
+        "    iterator begin() { resume(handle); return iterator(handle); }\n"
+        "    std::default_sentinel_t end() const { return {}; }\n"
+        "private:\n"
+        "    std::coroutine_handle<promise_type> handle;\n"
+        "    bool iterating = false;\n"
+        "    static void resume(std::coroutine_handle<promise_type> handle) {\n"
+        "        if (handle.done()) return;\n"
+        "        handle.resume();\n"
+        "        if (handle.promise().error) std::rethrow_exception(std::exchange(handle.promise().error, nullptr));\n"
         "    }\n"
-        "    const T& operator[](size_t index) const {\n"
-        "        if (index >= data.size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `vector` with \"+std::to_string(data.size())+\" elements\");\n"
+        "};\n"
+        "}\n\n"
+    );
+
+    // tables of `table(size, function)`, filled by the compiler when they are comptime values
+    if(injectExtras)
+    newTokens.emplace_back(
+        "namespace cimple {\n"
+        "template <typename T, size_t N>\n"
+        "class Table {\n"
+        "public:\n"
+        "    T data[N];\n"
+        "    constexpr const Table* operator->() const {return this;} // optimized away by -O2 \n"
+        "    constexpr void lock() const {}\n"
+        "    constexpr void unlock() const {}\n"
+        "    constexpr const T* begin() const { return data; }\n"
+        "    constexpr const T* end() const { return data + N; }\n"
+        "    constexpr size_t size() const { return N; }\n"
+        "    constexpr const T& operator[](size_t index) const {\n"
+        "        if (index >= N) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `table` with \"+std::to_string(N)+\" elements\");\n"
         "        return data[index];\n"
         "    }\n"
-        "    void set(size_t index, const T& value) {\n"
-        "        if (index >= data.size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `vector` with \"+std::to_string(data.size())+\" elements\");\n"
-        "        data[index] = value;\n"
-        "    }\n"
-        "    void pop() {\n"
-        "        if (data.empty()) throw std::out_of_range(\"Pop from empty SafeVector\");\n"
-        "        if (itercount) throw std::out_of_range(\"Cannot pop from an iterating vector.\");"
+        "};\n"
+        "template <size_t N, typename F>\n"
+        "constexpr auto table(F f) {\n"
+        "    Table<std::remove_cvref_t<decltype(f(size_t()))>, N> result{};\n"
+        "    for (size_t i = 0; i < N; ++i)\n"
+        "        result.data[i] = f(i);\n"
+        "    return result;\n"
+        "}\n"
+        "}\n\n"
+    );
+
+    // lazy pipelines of map, filter and zip, consumed by sum, count, reduce and vector construction in one fused loop
+    if(injectExtras)
+    newTokens.emplace_back(
+        "\n#include <functional>\n#include <tuple>\n"
+        "namespace cimple {\n"
+        "// map, filter and zip are lazy stages over vectors, generators and other stages. sum, count, reduce and vector\n"
+        "// construction push every item through all stages in a single loop, without intermediate vectors.\n"
+        "template <typename T> T& range(const SafeSharedPtr<T>& pointer) { return *pointer; }\n"
+        "template <typename T> T& range(SafeSharedPtr<T>& pointer) { return *pointer; }\n"
+        "template <typename Source> Source& range(Source& source) { return source; }\n"
+        "template <typename Source> using item_t = std::remove_cvref_t<decltype(*cimple::range(std::declval<Source&>()).begin())>;\n"
+        "template <typename Stage> concept Pipeline = std::remove_cvref_t<Stage>::lazy;\n"
+        "\n"
+        "template <typename Source>\n"
+        "struct Locked {\n"
+        "    Source& source;\n"
+        "    explicit Locked(Source& source) : source(source) { source->lock(); }\n"
+        "    ~Locked() { source->unlock(); }\n"
+        "};\n"
+        "\n"
+        "// items of zipped stages are passed as separate arguments, as in map(zip(x, y), +)\n"
+        "template <typename F, typename... Items>\n"
+        "decltype(auto) call(F& f, Items&&... items) {\n"
+        "    if constexpr (sizeof...(Items) == 1 && !std::is_invocable_v<F&, Items...>)\n"
+        "        return std::apply(f, std::forward<Items>(items)...);\n"
+        "    else\n"
+        "        return f(std::forward<Items>(items)...);\n"
+        "}\n"
+        "\n"
+        "template <typename Source, typename Sink>\n"
+        "void each(Source& source, Sink&& sink) {\n"
+        "    if constexpr (Pipeline<Source>)\n"
+        "        source.each(sink);\n"
+        "    else {\n"
+        "        Locked lock(source);\n"
+        "        for (const auto& item : cimple::range(source))\n"
+        "            sink(item);\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "template <typename Iterator, typename End, typename F>\n"
+        "class MapIterator {\n"
+        "private:\n"
+        "    Iterator it;\n"
+        "    End end;\n"
+        "    F* f;\n"
+        "public:\n"
+        "    MapIterator(Iterator it, End end, F* f) : it(it), end(end), f(f) {}\n"
+        "    decltype(auto) operator*() const { return cimple::call(*f, *it); }\n"
+        "    MapIterator& operator++() { ++it; return *this; }\n"
+        "    bool operator!=(std::default_sentinel_t) const { return it != end; }\n"
+        "};\n"
+        "\n"
+        "template <typename Iterator, typename End, typename F>\n"
+        "class FilterIterator {\n"
+        "private:\n"
+        "    Iterator it;\n"
+        "    End end;\n"
+        "    F* f;\n"
+        "    void skip() { while (it != end && !cimple::call(*f, *it)) ++it; }\n"
+        "public:\n"
+        "    FilterIterator(Iterator it, End end, F* f) : it(it), end(end), f(f) { skip(); }\n"
+        "    decltype(auto) operator*() const { return *it; }\n"
+        "    FilterIterator& operator++() { ++it; skip(); return *this; }\n"
+        "    bool operator!=(std::default_sentinel_t) const { return it != end; }\n"
+        "};\n"
+        "\n"
+        "template <typename First, typename FirstEnd, typename Second, typename SecondEnd>\n"
+        "class ZipIterator {\n"
+        "private:\n"
+        "    First first;\n"
+        "    FirstEnd firstEnd;\n"
+        "    Second second;\n"
+        "    SecondEnd secondEnd;\n"
+        "public:\n"
+        "    ZipIterator(First first, FirstEnd firstEnd, Second second, SecondEnd secondEnd) : first(first), firstEnd(firstEnd), second(second), secondEnd(secondEnd) {}\n"
+        "    auto operator*() const { return std::pair<decltype(*first), decltype(*second)>(*first, *second); }\n"
+        "    ZipIterator& operator++() { ++first; ++second; return *this; }\n"
+        "    bool operator!=(std::default_sentinel_t) const { return first != firstEnd && second != secondEnd; }\n"
+        "};\n"
+        "\n"
+        "// stages hold references to named sources and take ownership of temporaries, such as generators and inner stages\n"
+        "template <typename Source, typename F>\n"
+        "class Map {\n"
+        "private:\n"
+        "    Source source;\n"
+        "    F f;\n"
+        "public:\n"
+        "    static constexpr bool lazy = true;\n"
+        "    Map(Source&& source, F f) : source(std::forward<Source>(source)), f(f) {}\n"
+        "    Map* operator->() {return this;} // optimized away by -O2 \n"
+        "    void lock() { source->lock(); }\n"
+        "    void unlock() { source->unlock(); }\n"
+        "    auto begin() { return MapIterator(cimple::range(source).begin(), cimple::range(source).end(), &f); }\n"
+        "    std::default_sentinel_t end() const { return {}; }\n"
+        "    size_t size() requires requires { cimple::range(source).size(); } { return cimple::range(source).size(); }\n"
+        "    template <typename Sink> void each(Sink& sink) { cimple::each(source, [&](const auto& item) { sink(cimple::call(f, item)); }); }\n"
+        "};\n"
+        "\n"
+        "template <typename Source, typename F>\n"
+        "class Filter {\n"
+        "private:\n"
+        "    Source source;\n"
+        "    F f;\n"
+        "public:\n"
+        "    static constexpr bool lazy = true;\n"
+        "    Filter(Source&& source, F f) : source(std::forward<Source>(source)), f(f) {}\n"
+        "    Filter* operator->() {return this;} // optimized away by -O2 \n"
+        "    void lock() { source->lock(); }\n"
+        "    void unlock() { source->unlock(); }\n"
+        "    auto begin() { return FilterIterator(cimple::range(source).begin(), cimple::range(source).end(), &f); }\n"
+        "    std::default_sentinel_t end() const { return {}; }\n"
+        "    template <typename Sink> void each(Sink& sink) { cimple::each(source, [&](const auto& item) { if (cimple::call(f, item)) sink(item); }); }\n"
+        "};\n"
+        "\n"
+        "template <typename First, typename Second>\n"
+        "class Zip {\n"
+        "private:\n"
+        "    First first;\n"
+        "    Second second;\n"
+        "public:\n"
+        "    static constexpr bool lazy = true;\n"
+        "    Zip(First&& first, Second&& second) : first(std::forward<First>(first)), second(std::forward<Second>(second)) {}\n"
+        "    Zip* operator->() {return this;} // optimized away by -O2 \n"
+        "    void lock() { first->lock(); second->lock(); }\n"
+        "    void unlock() { first->unlock(); second->unlock(); }\n"
+        "    auto begin() { return ZipIterator(cimple::range(first).begin(), cimple::range(first).end(), cimple::range(second).begin(), cimple::range(second).end()); }\n"
+        "    std::default_sentinel_t end() const { return {}; }\n"
+        "    size_t size() requires requires { cimple::range(first).size(); cimple::range(second).size(); } {\n"
+        "        return std::min<size_t>(cimple::range(first).size(), cimple::range(second).size());\n"
+        "    }\n"
+        "    template <typename Sink> void each(Sink& sink) {\n"
+        "        Locked lockFirst(first);\n"
+        "        Locked lockSecond(second);\n"
+        "        if constexpr (requires { this->size(); }) {\n"
+        "            // counted, so that the compiler can vectorize the loop\n"
+        "            auto x = cimple::range(first).begin();\n"
+        "            auto y = cimple::range(second).begin();\n"
+        "            for (size_t i = 0, n = size(); i < n; ++i, ++x, ++y)\n"
+        "                sink(std::pair<decltype(*x), decltype(*y)>(*x, *y));\n"
+        "        }\n"
+        "        else\n"
+        "            for (auto item = begin(); item != end(); ++item)\n"
+        "                sink(*item);\n"
+        "    }\n"
+        "};\n"
+        "\n"
+        "template <typename Source, typename F> auto map(Source&& source, F f) { return Map<Source, F>(std::forward<Source>(source), f); }\n"
+        "template <typename Source, typename F> auto filter(Source&& source, F f) { return Filter<Source, F>(std::forward<Source>(source), f); }\n"
+        "template <typename First, typename Second> auto zip(First&& first, Second&& second) { return Zip<First, Second>(std::forward<First>(first), std::forward<Second>(second)); }\n"
+        "\n"
+        "template <typename Source, typename F, typename T>\n"
+        "T reduce(Source&& source, F f, T initial) {\n"
+        "    cimple::each(source, [&](const auto& item) { initial = cimple::call(f, initial, item); });\n"
+        "    return initial;\n"
+        "}\n"
+        "template <typename Source>\n"
+        "auto sum(Source&& source) {\n"
+        "    item_t<std::remove_reference_t<Source>> total{};\n"
+        "    cimple::each(source, [&](const auto& item) { total += item; });\n"
+        "    return total;\n"
+        "}\n"
+        "template <typename Source>\n"
+        "size_t count(Source&& source) {\n"
+        "    size_t total = 0;\n"
+        "    cimple::each(source, [&](const auto&) { ++total; });\n"
+        "    return total;\n"
+        "}\n"
+        "}\n\n"
+    );
+
+    // strings of `str`, with short texts inline and long ones shared, and `str_view` slices of them
+    if(injectExtras)
+    newTokens.emplace_back(
+        "\n#include <mutex>\n#include <unordered_map>\n#include <cstdint>\n"
+        "namespace cimple {\n"
+        "class str_view;\n"
+        "// Immutable strings of 16 bytes. Up to 15 characters are stored inline, so short keys never allocate and compare as\n"
+        "// two words; longer text lives in a reference-counted buffer that copies share. Interned strings share one buffer per\n"
+        "// distinct text, so comparing them only compares pointers.\n"
+        "class str {\n"
+        "private:\n"
+        "    struct Buffer {\n"
+        "        std::atomic<size_t> references;\n"
+        "        size_t size;\n"
+        "        size_t hash;\n"
+        "        bool interned;\n"
+        "        char* chars() { return reinterpret_cast<char*>(this + 1); }\n"
+        "    };\n"
+        "    static constexpr size_t inlined = 15;\n"
+        "    static constexpr char shared = char(-1); // tag of texts in a buffer; inline texts keep 15 - size there\n"
+        "    alignas(8) char bytes[16];\n"
+        "\n"
+        "    bool heap() const { return bytes[15] == shared; }\n"
+        "    Buffer* buffer() const { Buffer* buffer; std::memcpy(&buffer, bytes, sizeof(buffer)); return buffer; }\n"
+        "    void assign(const char* chars, size_t size) {\n"
+        "        std::memset(bytes, 0, sizeof(bytes));\n"
+        "        if (size <= inlined) {\n"
+        "            std::memcpy(bytes, chars, size);\n"
+        "            bytes[15] = char(inlined - size);\n"
+        "            return;\n"
+        "        }\n"
+        "        Buffer* buffer = static_cast<Buffer*>(::operator new(sizeof(Buffer) + size + 1));\n"
+        "        new (buffer) Buffer{{1}, size, std::hash<std::string_view>{}(std::string_view(chars, size)), false};\n"
+        "        std::memcpy(buffer->chars(), chars, size);\n"
+        "        buffer->chars()[size] = 0;\n"
+        "        std::memcpy(bytes, &buffer, sizeof(buffer));\n"
+        "        bytes[15] = shared;\n"
+        "    }\n"
+        "    void release() {\n"
+        "        if (heap() && !buffer()->interned && --buffer()->references == 0) {\n"
+        "            buffer()->~Buffer();\n"
+        "            ::operator delete(buffer());\n"
+        "        }\n"
+        "    }\n"
+        "    static std::unordered_map<std::string_view, str>& interned() {\n"
+        "        static auto* table = new std::unordered_map<std::string_view, str>(); // never destroyed, as interned texts may outlive it\n"
+        "        return *table;\n"
+        "    }\n"
+        "\n"
+        "public:\n"
+        "    str() { std::memset(bytes, 0, sizeof(bytes)); bytes[15] = char(inlined); }\n"
+        "    str(const char* chars) { assign(chars, std::strlen(chars)); }\n"
+        "    str(std::string_view text) { assign(text.data(), text.size()); }\n"
+        "    str(const std::string& text) { assign(text.data(), text.size()); }\n"
+        "    template <typename T> requires std::is_arithmetic_v<T>\n"
+        "    explicit str(T value) : str(string(value)) {}\n"
+        "    explicit str(const str_view& view);\n"
+        "    str(const str& other) { std::memcpy(bytes, other.bytes, sizeof(bytes)); if (heap()) ++buffer()->references; }\n"
+        "    str(str&& other) noexcept { std::memcpy(bytes, other.bytes, sizeof(bytes)); other.bytes[15] = char(inlined); std::memset(other.bytes, 0, 15); }\n"
+        "    str& operator=(str other) noexcept { std::swap(bytes, other.bytes); return *this; }\n"
+        "    ~str() { release(); }\n"
+        "    str* operator->() {return this;} // optimized away by -O2 \n"
+        "    const str* operator->() const {return this;} // optimized away by -O2 \n"
+        "\n"
+        "    size_t size() const { return heap() ? buffer()->size : inlined - bytes[15]; }\n"
+        "    bool empty() const { return !size(); }\n"
+        "    const char* data() const { return heap() ? buffer()->chars() : bytes; }\n"
+        "    operator std::string_view() const { return std::string_view(data(), size()); }\n"
+        "    char operator[](size_t index) const {\n"
+        "        if (index >= size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `str` with \"+std::to_string(size())+\" characters\");\n"
+        "        return data()[index];\n"
+        "    }\n"
+        "    str_view slice(size_t start, size_t end) const;\n"
+        "    bool starts_with(std::string_view text) const { return std::string_view(*this).starts_with(text); }\n"
+        "    bool ends_with(std::string_view text) const { return std::string_view(*this).ends_with(text); }\n"
+        "    bool contains(std::string_view text) const { return std::string_view(*this).find(text) != std::string_view::npos; }\n"
+        "    long find(std::string_view text) const { size_t at = std::string_view(*this).find(text); return at == std::string_view::npos ? -1 : long(at); }\n"
+        "    // the shared copy of this text; short texts are already compared in constant time\n"
+        "    str intern() const {\n"
+        "        if (!heap() || buffer()->interned) return *this;\n"
+        "        static std::mutex mutex;\n"
+        "        std::lock_guard<std::mutex> lock(mutex);\n"
+        "        auto found = interned().find(*this);\n"
+        "        if (found != interned().end()) return found->second;\n"
+        "        str copy(std::string_view(*this));\n"
+        "        copy.buffer()->interned = true;\n"
+        "        interned().emplace(std::string_view(copy), copy);\n"
+        "        return copy;\n"
+        "    }\n"
+        "    size_t hash() const {\n"
+        "        if (heap()) return buffer()->hash;\n"
+        "        uint64_t words[2];\n"
+        "        std::memcpy(words, bytes, sizeof(words));\n"
+        "        return (words[0] * 0x9E3779B97F4A7C15ull) ^ (words[1] + (words[1] >> 29));\n"
+        "    }\n"
+        "    friend bool operator==(const str& a, const str& b) {\n"
+        "        if (std::memcmp(a.bytes, b.bytes, sizeof(a.bytes)) == 0) return true; // same inline text or same buffer\n"
+        "        if (!a.heap() || !b.heap()) return false; // texts are inline exactly when they are short, so sizes differ\n"
+        "        Buffer* x = a.buffer();\n"
+        "        Buffer* y = b.buffer();\n"
+        "        if (x->interned && y->interned) return false;\n"
+        "        return x->size == y->size && x->hash == y->hash && std::memcmp(x->chars(), y->chars(), x->size) == 0;\n"
+        "    }\n"
+        "    friend bool operator==(const str& a, std::string_view b) { return std::string_view(a) == b; }\n"
+        "    friend bool operator==(const str& a, const char* b) { return std::string_view(a) == b; }\n"
+        "    friend auto operator<=>(const str& a, const str& b) { return std::string_view(a) <=> std::string_view(b); }\n"
+        "    static str concat(std::string_view a, std::string_view b) {\n"
+        "        str result;\n"
+        "        result.release();\n"
+        "        if (a.size() + b.size() <= inlined) {\n"
+        "            std::memcpy(result.bytes, a.data(), a.size());\n"
+        "            std::memcpy(result.bytes + a.size(), b.data(), b.size());\n"
+        "            result.bytes[15] = char(inlined - a.size() - b.size());\n"
+        "            return result;\n"
+        "        }\n"
+        "        std::string text;\n"
+        "        text.reserve(a.size() + b.size());\n"
+        "        text.append(a);\n"
+        "        text.append(b);\n"
+        "        return str(text);\n"
+        "    }\n"
+        "    friend str operator+(const str& a, const str& b) { return concat(a, b); }\n"
+        "    friend str operator+(const str& a, std::string_view b) { return concat(a, b); }\n"
+        "    friend str operator+(std::string_view a, const str& b) { return concat(a, b); }\n"
+        "    friend str operator+(const str& a, const char* b) { return concat(a, b); }\n"
+        "    friend str operator+(const char* a, const str& b) { return concat(a, b); }\n"
+        "};\n"
+        "\n"
+        "// Slices of a str without copying the text. The view holds its own reference to the text, so it stays valid when\n"
+        "// the str it was taken from is reassigned or goes out of scope.\n"
+        "class str_view {\n"
+        "private:\n"
+        "    str owner;\n"
+        "    size_t start;\n"
+        "    size_t length;\n"
+        "    str_view(const str& owner, size_t start, size_t length) : owner(owner), start(start), length(length) {}\n"
+        "    friend class str;\n"
+        "public:\n"
+        "    str_view* operator->() {return this;} // optimized away by -O2 \n"
+        "    const str_view* operator->() const {return this;} // optimized away by -O2 \n"
+        "    size_t size() const { return length; }\n"
+        "    bool empty() const { return !length; }\n"
+        "    operator std::string_view() const { return std::string_view(owner.data() + start, length); }\n"
+        "    char operator[](size_t index) const {\n"
+        "        if (index >= length) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `str_view` with \"+std::to_string(length)+\" characters\");\n"
+        "        return owner.data()[start + index];\n"
+        "    }\n"
+        "    str_view slice(size_t from, size_t to) const {\n"
+        "        if (from > to || to > length) throw std::out_of_range(\"Slice \"+std::to_string(from)+\"..\"+std::to_string(to)+\" out of bounds in `str_view` with \"+std::to_string(length)+\" characters\");\n"
+        "        return str_view(owner, start + from, to - from);\n"
+        "    }\n"
+        "    bool starts_with(std::string_view text) const { return std::string_view(*this).starts_with(text); }\n"
+        "    bool ends_with(std::string_view text) const { return std::string_view(*this).ends_with(text); }\n"
+        "    bool contains(std::string_view text) const { return std::string_view(*this).find(text) != std::string_view::npos; }\n"
+        "    long find(std::string_view text) const { size_t at = std::string_view(*this).find(text); return at == std::string_view::npos ? -1 : long(at); }\n"
+        "    friend bool operator==(const str_view& a, std::string_view b) { return std::string_view(a) == b; }\n"
+        "    friend bool operator==(const str_view& a, const str& b) { return std::string_view(a) == std::string_view(b); }\n"
+        "    friend bool operator==(const str_view& a, const char* b) { return std::string_view(a) == b; }\n"
+        "};\n"
+        "\n"
+        "inline str::str(const str_view& view) : str(std::string_view(view)) {}\n"
+        "inline str_view str::slice(size_t start, size_t end) const {\n"
+        "    if (start > end || end > size()) throw std::out_of_range(\"Slice \"+std::to_string(start)+\"..\"+std::to_string(end)+\" out of bounds in `str` with \"+std::to_string(size())+\" characters\");\n"
+        "    return str_view(*this, start, end - start);\n"
+        "}\n"
+        "}\n"
+        "template <> struct std::hash<cimple::str> {\n"
+        "    size_t operator()(const cimple::str& text) const { return text.hash(); }\n"
+        "};\n\n"
+    );
+
+    // bench blocks, which only run when `cimple bench` starts the program
+    if(injectExtras)
+    newTokens.emplace_back(
+        "\n#include <chrono>\n#include <algorithm>\n#include <cstdio>\n#include <cstdlib>\n"
+        "namespace cimple {\n"
+        "// makes the compiler assume that the value is used, so that benchmarked code is not optimized away\n"
+        "template <typename T>\n"
+        "inline void keep(const T& value) { asm volatile(\"\" : : \"r,m\"(value) : \"memory\"); }\n"
+        "\n"
+        "namespace bench {\n"
+        "struct Benchmark {\n"
+        "    const char* name;\n"
+        "    void (*run)(size_t iterations);\n"
+        "};\n"
+        "inline std::vector<Benchmark>& all() {\n"
+        "    static std::vector<Benchmark> benchmarks;\n"
+        "    return benchmarks;\n"
+        "}\n"
+        "inline bool add(const char* name, void (*run)(size_t)) {\n"
+        "    all().push_back({name, run});\n"
+        "    return true;\n"
+        "}\n"
+        "inline bool requested() { return std::getenv(\"CIMPLE_BENCH\"); }\n"
+        "\n"
+        "inline double nanoseconds(const Benchmark& benchmark, size_t iterations) {\n"
+        "    auto start = std::chrono::steady_clock::now();\n"
+        "    benchmark.run(iterations);\n"
+        "    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();\n"
+        "}\n"
+        "\n"
+        "// Times every bench block and writes one JSON object per line to the file named by CIMPLE_BENCH. Iterations are\n"
+        "// batched so that each timed sample lasts about 10ms, which also warms caches and branch predictors up; samples\n"
+        "// are taken for about one second.\n"
+        "inline int run() {\n"
+        "    if (!requested()) {\n"
+        "        std::fprintf(stderr, \"This program only has bench blocks. Use `cimple bench` to run them.\\n\");\n"
+        "        return 1;\n"
+        "    }\n"
+        "    FILE* results = std::fopen(std::getenv(\"CIMPLE_BENCH\"), \"w\");\n"
+        "    if (!results) {\n"
+        "        std::fprintf(stderr, \"Could not write benchmark results to %s\\n\", std::getenv(\"CIMPLE_BENCH\"));\n"
+        "        return 1;\n"
+        "    }\n"
+        "    for (const Benchmark& benchmark : all()) {\n"
+        "        size_t batch = 1;\n"
+        "        nanoseconds(benchmark, batch);\n"
+        "        while (batch < (size_t(1) << 40) && nanoseconds(benchmark, batch) < 1e7)\n"
+        "            batch *= 2;\n"
+        "        std::vector<double> samples;\n"
+        "        double total = 0;\n"
+        "        while (samples.size() < 10 || (total < 1e9 && samples.size() < 1000)) {\n"
+        "            double elapsed = nanoseconds(benchmark, batch);\n"
+        "            samples.push_back(elapsed / batch);\n"
+        "            total += elapsed;\n"
+        "        }\n"
+        "        std::sort(samples.begin(), samples.end());\n"
+        "        double mean = total / (batch * samples.size());\n"
+        "        std::fputs(\"{\\\"name\\\": \\\"\", results);\n"
+        "        for (const char* c = benchmark.name; *c; ++c) {\n"
+        "            if (*c == '\"' || *c == '\\\\') std::fputc('\\\\', results);\n"
+        "            std::fputc(*c, results);\n"
+        "        }\n"
+        "        std::fprintf(results, \"\\\", \\\"iterations\\\": %zu, \\\"mean\\\": %.3f, \\\"median\\\": %.3f, \\\"p99\\\": %.3f}\\n\", batch * samples.size(),\n"
+        "                     mean, samples[samples.size() / 2], samples[std::min(samples.size() - 1, samples.size() * 99 / 100)]);\n"
+        "    }\n"
+        "    std::fclose(results);\n"
+        "    return 0;\n"
+        "}\n"
+        "}\n"
+        "}\n\n"
+    );
+
+    // `--profile` timing of every func and method, reported at exit
+    if(injectExtras && profiling)
+    newTokens.emplace_back(
+        "\n#include <chrono>\n#include <algorithm>\n#include <cstdio>\n#include <cstdlib>\n#include <cstring>\n#include <cstdint>\n#include <deque>\n#include <mutex>\n"
+        "namespace cimple::profile {\n"
+        "// A func or method, registered once per (module, name) so that template instances share their entry\n"
+        "struct Site {\n"
+        "    uint32_t id;\n"
+        "    Site(const char* module, const char* name);\n"
+        "};\n"
+        "struct Node {\n"
+        "    uint32_t site;\n"
+        "    Node* parent;\n"
+        "    std::vector<Node*> children;\n"
+        "    uint64_t calls = 0;\n"
+        "    uint64_t total = 0; // nanoseconds, including the calls that this one makes\n"
+        "};\n"
+        "struct Event {\n"
+        "    uint32_t site;\n"
+        "    uint64_t start;\n"
+        "    uint64_t duration;\n"
+        "};\n"
+        "// Call tree and trace of one thread, which stays registered after the thread exits\n"
+        "struct Thread {\n"
+        "    uint32_t id;\n"
+        "    std::deque<Node> nodes;\n"
+        "    Node* current;\n"
+        "    std::vector<Event> events;\n"
+        "    uint64_t dropped = 0;\n"
+        "    explicit Thread(uint32_t id) : id(id), nodes(1, Node{0, nullptr}), current(&nodes.front()) {}\n"
+        "    Node* enter(uint32_t site) {\n"
+        "        for (Node* child : current->children)\n"
+        "            if (child->site == site)\n"
+        "                return current = child;\n"
+        "        nodes.push_back(Node{site, current});\n"
+        "        current->children.push_back(&nodes.back());\n"
+        "        return current = &nodes.back();\n"
+        "    }\n"
+        "};\n"
+        "struct Registry {\n"
+        "    std::mutex mutex;\n"
+        "    std::vector<std::pair<const char*, const char*>> sites;\n"
+        "    std::vector<Thread*> threads;\n"
+        "};\n"
+        "// never destroyed, so that threads and static destructors may still be timed while the report is printed\n"
+        "inline Registry& registry() {\n"
+        "    static Registry* registry = new Registry();\n"
+        "    return *registry;\n"
+        "}\n"
+        "inline const char* traceFile = \"" + escape(profileTrace) + "\";\n"
+        "inline const uint64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();\n"
+        "inline uint64_t now() {\n"
+        "    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - epoch;\n"
+        "}\n"
+        "inline Thread& thread() {\n"
+        "    thread_local Thread* thread = [] {\n"
+        "        Registry& all = registry();\n"
+        "        std::lock_guard<std::mutex> lock(all.mutex);\n"
+        "        all.threads.push_back(new Thread(all.threads.size() + 1));\n"
+        "        return all.threads.back();\n"
+        "    }();\n"
+        "    return *thread;\n"
+        "}\n"
+        "\n"
+        "inline void duration(char* text, size_t size, double nanoseconds) {\n"
+        "    if (nanoseconds >= 1e9) std::snprintf(text, size, \"%.2f s\", nanoseconds / 1e9);\n"
+        "    else if (nanoseconds >= 1e6) std::snprintf(text, size, \"%.2f ms\", nanoseconds / 1e6);\n"
+        "    else if (nanoseconds >= 1e3) std::snprintf(text, size, \"%.2f us\", nanoseconds / 1e3);\n"
+        "    else std::snprintf(text, size, \"%.0f ns\", nanoseconds);\n"
+        "}\n"
+        "inline void tree(const Registry& all, const Node& node, int depth, double program) {\n"
+        "    std::vector<const Node*> children(node.children.begin(), node.children.end());\n"
+        "    std::sort(children.begin(), children.end(), [](const Node* a, const Node* b) { return a->total > b->total; });\n"
+        "    for (const Node* child : children) {\n"
+        "        if (child->total < program / 1000) // below 0.1% of the run\n"
+        "            continue;\n"
+        "        char total[32];\n"
+        "        duration(total, sizeof(total), child->total);\n"
+        "        std::fprintf(stderr, \"%*s%s: %-*s %10llu %12s %6.1f%%\\n\", depth * 2, \"\", all.sites[child->site].first, std::max(0, 40 - depth * 2 - int(std::strlen(all.sites[child->site].first))),\n"
+        "                     all.sites[child->site].second, (unsigned long long)child->calls, total, 100 * child->total / program);\n"
+        "        tree(all, *child, depth + 1, program);\n"
+        "    }\n"
+        "}\n"
+        "// Writes a JSON string, escaping what module paths and names may contain\n"
+        "inline void quoted(FILE* file, const char* text) {\n"
+        "    std::fputc('\"', file);\n"
+        "    for (const char* c = text; *c; ++c) {\n"
+        "        if (*c == '\"' || *c == '\\\\') std::fputc('\\\\', file);\n"
+        "        if (static_cast<unsigned char>(*c) < 0x20) std::fprintf(file, \"\\\\u%04x\", *c);\n"
+        "        else std::fputc(*c, file);\n"
+        "    }\n"
+        "    std::fputc('\"', file);\n"
+        "}\n"
+        "inline void trace(const Registry& all) {\n"
+        "    FILE* file = std::fopen(traceFile, \"w\");\n"
+        "    if (!file) {\n"
+        "        std::fprintf(stderr, \"Could not write the profile trace to %s\\n\", traceFile);\n"
+        "        return;\n"
+        "    }\n"
+        "    std::fputs(\"{\\\"traceEvents\\\": [\\n\", file);\n"
+        "    bool first = true;\n"
+        "    for (const Thread* thread : all.threads)\n"
+        "        for (const Event& event : thread->events) {\n"
+        "            std::fputs(first ? \"{\\\"name\\\": \" : \",\\n{\\\"name\\\": \", file);\n"
+        "            quoted(file, all.sites[event.site].second);\n"
+        "            std::fputs(\", \\\"cat\\\": \", file);\n"
+        "            quoted(file, all.sites[event.site].first);\n"
+        "            std::fprintf(file, \", \\\"ph\\\": \\\"X\\\", \\\"ts\\\": %.3f, \\\"dur\\\": %.3f, \\\"pid\\\": 1, \\\"tid\\\": %u}\",\n"
+        "                         event.start / 1e3, event.duration / 1e3, thread->id);\n"
+        "            first = false;\n"
+        "        }\n"
+        "    std::fputs(\"\\n]}\\n\", file);\n"
+        "    std::fclose(file);\n"
+        "    std::fprintf(stderr, \"Wrote the profile trace to %s\\n\", traceFile);\n"
+        "}\n"
+        "// Prints the time spent in each func, and in each chain of calls, once the program exits\n"
+        "inline void report() {\n"
+        "    Registry& all = registry();\n"
+        "    std::lock_guard<std::mutex> lock(all.mutex);\n"
+        "    std::vector<uint64_t> calls(all.sites.size()), self(all.sites.size()), total(all.sites.size());\n"
+        "    std::vector<int> active(all.sites.size()); // recursive calls are only counted once towards the total\n"
+        "    double program = 0;\n"
+        "    uint64_t dropped = 0;\n"
+        "    for (const Thread* thread : all.threads) {\n"
+        "        for (const Node* child : thread->nodes.front().children)\n"
+        "            program += child->total;\n"
+        "        dropped += thread->dropped;\n"
+        "        auto visit = [&](auto& visit, const Node& node) -> void {\n"
+        "            uint64_t children = 0;\n"
+        "            for (const Node* child : node.children)\n"
+        "                children += child->total;\n"
+        "            calls[node.site] += node.calls;\n"
+        "            self[node.site] += node.total > children ? node.total - children : 0;\n"
+        "            if (!active[node.site]++)\n"
+        "                total[node.site] += node.total;\n"
+        "            for (const Node* child : node.children)\n"
+        "                visit(visit, *child);\n"
+        "            --active[node.site];\n"
+        "        };\n"
+        "        for (const Node* child : thread->nodes.front().children)\n"
+        "            visit(visit, *child);\n"
+        "    }\n"
+        "    std::vector<uint32_t> order;\n"
+        "    for (uint32_t site = 0; site < all.sites.size(); ++site)\n"
+        "        if (calls[site])\n"
+        "            order.push_back(site);\n"
+        "    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return self[a] > self[b]; });\n"
+        "    program = std::max(program, 1.0);\n"
+        "    std::fprintf(stderr, \"---------------- Profile -------------------\\n\");\n"
+        "    std::fprintf(stderr, \"%-42s %10s %12s %7s %12s\\n\", \"func\", \"calls\", \"self\", \"\", \"total\");\n"
+        "    for (uint32_t site : order) {\n"
+        "        char selfText[32], totalText[32];\n"
+        "        duration(selfText, sizeof(selfText), self[site]);\n"
+        "        duration(totalText, sizeof(totalText), total[site]);\n"
+        "        std::fprintf(stderr, \"%s: %-*s %10llu %12s %6.1f%% %12s\\n\", all.sites[site].first, std::max(0, 40 - int(std::strlen(all.sites[site].first))),\n"
+        "                     all.sites[site].second, (unsigned long long)calls[site], selfText, 100 * self[site] / program, totalText);\n"
+        "    }\n"
+        "    std::fprintf(stderr, \"\\n%-42s %10s %12s\\n\", \"call tree\", \"calls\", \"total\");\n"
+        "    for (const Thread* thread : all.threads) {\n"
+        "        if (all.threads.size() > 1)\n"
+        "            std::fprintf(stderr, \"thread %u\\n\", thread->id);\n"
+        "        tree(all, thread->nodes.front(), 0, program);\n"
+        "    }\n"
+        "    if (dropped)\n"
+        "        std::fprintf(stderr, \"The trace misses %llu calls past its limit of %zu per thread.\\n\", (unsigned long long)dropped, size_t(1) << 22);\n"
+        "    if (*traceFile)\n"
+        "        trace(all);\n"
+        "}\n"
+        "\n"
+        "inline Site::Site(const char* module, const char* name) {\n"
+        "    Registry& all = registry();\n"
+        "    std::lock_guard<std::mutex> lock(all.mutex);\n"
+        "    if (all.sites.empty()) {\n"
+        "        all.sites.emplace_back(\"\", \"\");  // the root of call trees\n"
+        "        std::atexit(report);\n"
+        "    }\n"
+        "    for (id = 1; id < all.sites.size(); ++id)\n"
+        "        if (!std::strcmp(all.sites[id].first, module) && !std::strcmp(all.sites[id].second, name))\n"
+        "            return;\n"
+        "    all.sites.emplace_back(module, name);\n"
+        "}\n"
+        "\n"
+        "// Times a call from its construction at the top of the func until it returns or throws\n"
+        "class Scope {\n"
+        "    Thread& thread;\n"
+        "    Node* node;\n"
+        "    uint64_t start;\n"
+        "public:\n"
+        "    explicit Scope(const Site& site) : thread(cimple::profile::thread()), node(thread.enter(site.id)), start(now()) {}\n"
+        "    ~Scope() {\n"
+        "        uint64_t end = now();\n"
+        "        node->calls++;\n"
+        "        node->total += end - start;\n"
+        "        thread.current = node->parent;\n"
+        "        if (*traceFile) {\n"
+        "            if (thread.events.size() < (size_t(1) << 22))\n"
+        "                thread.events.push_back({node->site, start, end - start});\n"
+        "            else\n"
+        "                thread.dropped++;\n"
+        "        }\n"
+        "    }\n"
+        "};\n"
+        "}\n\n"
+    );
+
+    if(injectExtras)
+    newTokens.emplace_back(
+        "template <typename T>\n"
+        "class SafeVector {\n"
+        "private:\n"
+        "    std::vector<T, cimple::memory::Allocator<T>> data;\n"
+        "    mutable std::atomic<int> itercount; // iterating a read-only vector still locks it\n"
+        "\n"
+        "public:\n"
+        "    SafeVector() = default;\n"
+        "    SafeVector(int size) : data(size), itercount(0) {}\n"
+        "    SafeVector(std::initializer_list<T> init) : data(init), itercount(0) {}\n"
+        "    template <cimple::Pipeline Stage>\n"
+        "    explicit SafeVector(Stage&& stage) : itercount(0) {\n"
+        "        if constexpr (requires { stage.size(); }) data.reserve(stage.size());\n"
+        "        cimple::each(stage, [&](const auto& item) { data.push_back(item); });\n"
+        "    }\n"
+        "    SafeVector(const SafeVector& other) = delete;\n"
+        "    SafeVector(SafeVector<T>&& other) : data(std::move(other.data)), itercount(0) {if(other.itercount) throw std::out_of_range(\"Cannot return a vector from within a loop.\");}\n"
+        "    operator auto() const {return data.begin();} \n"
+        "    auto lock() const { ++itercount; }\n"
+        "    auto unlock() const { --itercount; }\n"
+        "    auto begin() const { return data.begin(); }\n"
+        "    auto end() const { return data.end(); }\n"
+        "    size_t size() const { return data.size(); }\n"
+        "    SafeVector* operator->() {return this;} // optimized away by -O2 \n"
+        "    const SafeVector* operator->() const {return this;} // optimized away by -O2 \n"
+        "    T& operator[](size_t index) {\n"
+        "        if (index >= data.size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `vector` with \"+std::to_string(data.size())+\" elements\");\n"
+        "        return data[index];\n"
+        "    }\n"
+        "    const T& operator[](size_t index) const {\n"
+        "        if (index >= data.size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `vector` with \"+std::to_string(data.size())+\" elements\");\n"
+        "        return data[index];\n"
+        "    }\n"
+        "    void set(size_t index, const T& value) {\n"
+        "        if (index >= data.size()) throw std::out_of_range(\"Index \"+std::to_string(index)+\" casted from negative int or out of bounds in `vector` with \"+std::to_string(data.size())+\" elements\");\n"
+        "        data[index] = value;\n"
+        "    }\n"
+        "    void pop() {\n"
+        "        if (data.empty()) throw std::out_of_range(\"Pop from empty SafeVector\");\n"
+        "        if (itercount) throw std::out_of_range(\"Cannot pop from an iterating vector.\");"
         "        data.pop_back();\n"
         "    }\n"
         "    void reserve(size_t size) { data.reserve(size); }\n"
@@ -321,471 +2075,927 @@ std::vector<std::string> transformTokens(const std::vector<std::string>& tokens,
         "};\n\n"
     );
 
-    for(int i=0;i<tokens.size();++i) {
-        if(tokens[i]=="func") {
-            inConcept = false;
-            if(i>=tokens.size()-4) {
-                std::cerr << "`fn` function declaration was not complete" << std::endl;
-                exit(1);
-            }
-            if(tokens[i+1]=="main") {
-                newTokens.emplace_back("int");
-                continue;
-            }
-            newTokens.emplace_back("auto");
-            fnName = tokens[i+1];
-            newTokens.emplace_back(fnName);
-            declaring = true;
-            argNames.clear();
-            i += 1;
-            continue;
-        }
-        if(declaring && tokens[i]==")") 
-            declaring = false; // end declaration but continue normally
-
-        if(tokens[i]=="auto") {
-            std::cerr << "`auto` is not allowed. Use `var` to declare variables or `fn` to declare functions." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="void") {
-            std::cerr << "`void` is not allowed." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="delete") {
-            std::cerr << "`delete` is not allowed. Use `unbind` to let the memory handler process how the value should best be removed from this context." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="nullptr") {
-            std::cerr << "`nullptr` is not allowed. If you are trying to do `varname=nullptr;`, you may consider `unbind varname;` instead to let the memory handler process how the value should best be removed from this context." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="unbind") {
-            if(i>=tokens.size()-1) 
-                std::cerr << "Nothing to delete";
-            int pos = i+1;
-            while(pos<tokens.size()) {
-                if(tokens[pos]==";") {
-                    newTokens.emplace_back(".");
-                    newTokens.emplace_back("unbind()");
-                    newTokens.emplace_back(";");
-                    break;
-                }
-                newTokens.emplace_back(tokens[pos]);
-                pos++;
-            }
-            i = pos;
-            continue;
-        }
-        if(tokens[i]=="this") {
-            std::cerr << "`this` is not allowed. Use `self.` (note the fullstop) to access the struct's own fields." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="&") {
-            std::cerr << "`&` is not allowed. Construct `shared[type]` objects" << std::endl;
-            exit(1);
-        }
-        if(tokens[i][0]=='#') {
-            std::cerr << "Preprocessor directives are not allowed." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="class") {
-            std::cerr << "`class` is not allowed. Use `struct` instead." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="const") {
-            std::cerr << "`const` is not allowed as it is automatically applied." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="begin") {
-            std::cerr << "`begin` is not allowed as it is unsage and thus automatically applied when safeguards can be obtained" << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="end") {
-            std::cerr << "`end` is not allowed as it is unsage and thus automatically applied when safeguards can be obtained." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="new") {
-            std::cerr << "`new` is not allowed unless in the pattern handler.new(constuctor arguments)." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="-" && i<tokens.size()-1 && tokens[i+1]==">") {
-            std::cerr << "`->` is not allowed, as it is automatically inferred. Use `.` instead." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]==":") {
-            std::cerr << "`:` is not a valid syntax. Use `in` instead if you are in a for loop." << std::endl;
-            exit(1);
-        }
-        if(tokens[i]=="in") {
-            newTokens.emplace_back(":");
-            if(i<tokens.size()-1 && tokens[i+1]=="zip")
-                continue; // TODO: fix zip
-            int depth = 1;
-            i++;
-            newTokens.emplace_back("LockedIterable");
-            newTokens.emplace_back("(");
-            while(i<tokens.size()) {
-                newTokens.emplace_back(tokens[i]);
-                if(tokens[i]=="(")
-                    depth++;
-                if(tokens[i]==")")
-                    depth--;
-                if(depth==0)
-                    break;
-                i++;
-            }
-            newTokens.emplace_back(")");
-            continue;
-        }
-        if(tokens[i]=="zip") {
-            newTokens.emplace_back("std::views::zip");
-            continue;
-        }
-        if(namespaces.find(tokens[i])!=namespaces.end() && tokens[i]!="cimple") {
-            newTokens.emplace_back("cimple_"+tokens[i]);
-            continue;
-        }
-        if(tokens[i]=="." && newTokens[newTokens.size()-1][newTokens[newTokens.size()-1].size()-1]=='>') {
-            // we are just after a templated type, so do something according to the next token
-            if(i<tokens.size()-1 && tokens[i+1]=="new") {
-                i++; // also skip "new"
-                continue; // just continue and take the arguments
-            }
-            newTokens.push_back("(");
-            newTokens.push_back("(");
-            newTokens.push_back("->");
-            continue;
-        }
+    // flat hash maps of `map[K, V]`, locked like vectors while loops go through them
+    if(injectExtras)
+    newTokens.emplace_back(
+        "\n#include <cstdint>\n"
+        "#if defined(__SSE2__)\n"
+        "#include <emmintrin.h>\n"
+        "#endif\n"
+        "// flat open-addressing hash map: slots are grouped by 16 and each slot has a control byte, which is empty, deleted,\n"
+        "// or 7 bits of the hash of its key. A lookup compares the 16 control bytes of a group at once and only compares the\n"
+        "// keys of matching slots, so most lookups touch one group of control bytes and one key.\n"
+        "template <typename K, typename V>\n"
+        "class SafeMap {\n"
+        "private:\n"
+        "    using Slot = std::pair<K, V>;\n"
+        "    static constexpr size_t group = 16;\n"
+        "    static constexpr int8_t emptySlot = -128;\n"
+        "    static constexpr int8_t deletedSlot = -2;\n"
+        "    int8_t* control = nullptr;\n"
+        "    Slot* slots = nullptr;\n"
+        "    size_t capacity = 0; // a power of two number of groups\n"
+        "    size_t count = 0;\n"
+        "    size_t used = 0; // full and deleted slots, which both lengthen probes\n"
+        "    mutable std::atomic<int> itercount;\n"
+        "\n"
+        "    static size_t hash(const K& key) {\n"
+        "        size_t h = std::hash<K>{}(key) * 0x9E3779B97F4A7C15ull; // spreads identity hashes of integers\n"
+        "        return h ^ (h >> 32);\n"
+        "    }\n"
+        "    // bit i is set when control byte i of the group equals `byte`\n"
+        "    static uint32_t match(const int8_t* controls, int8_t byte) {\n"
+        "#if defined(__SSE2__)\n"
+        "        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(controls));\n"
+        "        return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(byte)));\n"
+        "#else\n"
+        "        uint32_t bits = 0;\n"
+        "        for (size_t i = 0; i < group; ++i) bits |= uint32_t(controls[i] == byte) << i;\n"
+        "        return bits;\n"
+        "#endif\n"
+        "    }\n"
+        "    // bit i is set when slot i of the group is empty or deleted, which are the negative control bytes\n"
+        "    static uint32_t vacant(const int8_t* controls) {\n"
+        "#if defined(__SSE2__)\n"
+        "        return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(controls)));\n"
+        "#else\n"
+        "        uint32_t bits = 0;\n"
+        "        for (size_t i = 0; i < group; ++i) bits |= uint32_t(controls[i] < 0) << i;\n"
+        "        return bits;\n"
+        "#endif\n"
+        "    }\n"
+        "    size_t find(const K& key) const {\n"
+        "        if (!capacity) return capacity;\n"
+        "        size_t h = hash(key);\n"
+        "        size_t mask = capacity / group - 1;\n"
+        "        for (size_t g = (h >> 7) & mask, step = 0; ; g = (g + ++step) & mask) { // triangular probing visits every group\n"
+        "            const int8_t* controls = control + g * group;\n"
+        "            for (uint32_t bits = match(controls, int8_t(h & 0x7F)); bits; bits &= bits - 1) {\n"
+        "                size_t slot = g * group + __builtin_ctz(bits);\n"
+        "                if (slots[slot].first == key) return slot;\n"
+        "            }\n"
+        "            if (match(controls, emptySlot)) return capacity;\n"
+        "        }\n"
+        "    }\n"
+        "    // first empty or deleted slot on the probes of hash `h`, which callers mark as full once its pair is constructed\n"
+        "    size_t vacancy(size_t h) const {\n"
+        "        size_t mask = capacity / group - 1;\n"
+        "        for (size_t g = (h >> 7) & mask, step = 0; ; g = (g + ++step) & mask)\n"
+        "            if (uint32_t bits = vacant(control + g * group))\n"
+        "                return g * group + __builtin_ctz(bits);\n"
+        "    }\n"
+        "    void guard(const char* message) const {\n"
+        "        if (itercount) throw std::out_of_range(message);\n"
+        "    }\n"
+        "    void release() {\n"
+        "        for (size_t i = 0; i < capacity; ++i)\n"
+        "            if (control[i] >= 0) slots[i].~Slot();\n"
+        "        ::operator delete(slots);\n"
+        "        delete[] control;\n"
+        "    }\n"
+        "    void rehash(size_t groups) {\n"
+        "        int8_t* oldControl = control;\n"
+        "        Slot* oldSlots = slots;\n"
+        "        size_t oldCapacity = capacity;\n"
+        "        capacity = groups * group;\n"
+        "        control = new int8_t[capacity];\n"
+        "        std::memset(control, emptySlot, capacity);\n"
+        "        slots = static_cast<Slot*>(::operator new(capacity * sizeof(Slot)));\n"
+        "        used = count;\n"
+        "        for (size_t i = 0; i < oldCapacity; ++i)\n"
+        "            if (oldControl[i] >= 0) {\n"
+        "                size_t h = hash(oldSlots[i].first);\n"
+        "                size_t slot = vacancy(h);\n"
+        "                new (slots + slot) Slot(std::move(oldSlots[i]));\n"
+        "                control[slot] = int8_t(h & 0x7F);\n"
+        "                oldSlots[i].~Slot();\n"
+        "            }\n"
+        "        ::operator delete(oldSlots);\n"
+        "        delete[] oldControl;\n"
+        "    }\n"
+        "    [[noreturn]] static void missing() { throw std::out_of_range(\"Key not found in `map`\"); }\n"
+        "\n"
+        "public:\n"
+        "    class iterator {\n"
+        "    private:\n"
+        "        const SafeMap* map;\n"
+        "        size_t slot;\n"
+        "        void skip() { while (slot < map->capacity && map->control[slot] < 0) ++slot; }\n"
+        "    public:\n"
+        "        iterator(const SafeMap* map, size_t slot) : map(map), slot(slot) { skip(); }\n"
+        "        const Slot& operator*() const { return map->slots[slot]; }\n"
+        "        iterator& operator++() { ++slot; skip(); return *this; }\n"
+        "        bool operator!=(const iterator& other) const { return slot != other.slot; }\n"
+        "    };\n"
+        "    SafeMap() : itercount(0) {}\n"
+        "    SafeMap(const SafeMap& other) = delete;\n"
+        "    SafeMap(SafeMap&& other) : control(other.control), slots(other.slots), capacity(other.capacity), count(other.count), used(other.used), itercount(0) {\n"
+        "        if (other.itercount) throw std::out_of_range(\"Cannot return a map from within a loop.\");\n"
+        "        other.control = nullptr; other.slots = nullptr; other.capacity = other.count = other.used = 0;\n"
+        "    }\n"
+        "    ~SafeMap() { release(); }\n"
+        "    SafeMap* operator->() {return this;} // optimized away by -O2 \n"
+        "    const SafeMap* operator->() const {return this;} // optimized away by -O2 \n"
+        "    auto lock() const { ++itercount; }\n"
+        "    auto unlock() const { --itercount; }\n"
+        "    iterator begin() const { return iterator(this, 0); }\n"
+        "    iterator end() const { return iterator(this, capacity); }\n"
+        "    size_t size() const { return count; }\n"
+        "    bool empty() const { return !count; }\n"
+        "    bool has(const K& key) const { return find(key) != capacity; }\n"
+        "    const V& get(const K& key) const { size_t slot = find(key); if (slot == capacity) missing(); return slots[slot].second; }\n"
+        "    V& get(const K& key) { size_t slot = find(key); if (slot == capacity) missing(); return slots[slot].second; }\n"
+        "    const V& operator[](const K& key) const { return get(key); }\n"
+        "    V& operator[](const K& key) { return get(key); }\n"
+        "    void set(const K& key, const V& value) {\n"
+        "        size_t slot = find(key);\n"
+        "        if (slot != capacity) { slots[slot].second = value; return; }\n"
+        "        guard(\"Cannot insert into an iterating map.\");\n"
+        "        if ((used + 1) * 8 > capacity * 7) // at most 7/8 of the slots are full or deleted\n"
+        "            rehash(count * 16 < capacity * 7 ? capacity / group : std::max<size_t>(capacity / group * 2, 1)); // or only drop tombstones\n"
+        "        size_t h = hash(key);\n"
+        "        slot = vacancy(h);\n"
+        "        new (slots + slot) Slot(key, value); // if copying the key or value throws, the slot stays vacant\n"
+        "        if (control[slot] == emptySlot) ++used;\n"
+        "        control[slot] = int8_t(h & 0x7F);\n"
+        "        ++count;\n"
+        "    }\n"
+        "    bool remove(const K& key) {\n"
+        "        size_t slot = find(key);\n"
+        "        if (slot == capacity) return false;\n"
+        "        guard(\"Cannot remove from an iterating map.\");\n"
+        "        slots[slot].~Slot();\n"
+        "        // probes stop at groups with an empty slot, so such groups need no tombstone\n"
+        "        const int8_t* controls = control + slot / group * group;\n"
+        "        control[slot] = match(controls, emptySlot) ? emptySlot : deletedSlot;\n"
+        "        if (control[slot] == emptySlot) --used;\n"
+        "        --count;\n"
+        "        return true;\n"
+        "    }\n"
+        "    void reserve(size_t size) {\n"
+        "        guard(\"Cannot reserve an iterating map.\");\n"
+        "        size_t groups = 1;\n"
+        "        while (groups * group * 7 < size * 8) groups *= 2;\n"
+        "        if (groups * group > capacity) rehash(groups);\n"
+        "    }\n"
+        "    void clear() {\n"
+        "        guard(\"Cannot clear an iterating map.\");\n"
+        "        release();\n"
+        "        control = nullptr; slots = nullptr; capacity = count = used = 0;\n"
+        "    }\n"
+        "};\n\n"
+    );
 
-        if(tokens[i]=="." && i && namespaces.find(tokens[i-1])!=namespaces.end() ) {
-            newTokens.emplace_back(":");
-            newTokens.emplace_back(":");
-            continue;
-        }
-        if(tokens[i]=="." && (i==0 || i>=tokens.size()-2 || !isNumber(tokens[i-1]) || !isNumber(tokens[i+1]))) {
-            newTokens.emplace_back("->");
-            continue;
-        }
-        if(tokens[i]=="type") {
-            if(i>=tokens.size()-3) {
-                std::cerr << "`type` definition is incomplete" << std::endl;
-                exit(1);
-            }
-            if(tokens[i+2]!="{") {
-                std::cerr << "Invalid `type` definition" << std::endl;
-                exit(1);
-            }
-            newTokens.emplace_back("template");
-            newTokens.emplace_back("<");
-            newTokens.emplace_back("typename T");
-            newTokens.emplace_back(">");
-            newTokens.emplace_back("concept");
-            newTokens.emplace_back(tokens[i+1]);
-            newTokens.emplace_back("=");
-            newTokens.emplace_back("requires");
-            newTokens.emplace_back("(");
-            newTokens.emplace_back("T");
-            newTokens.emplace_back("self");
-            newTokens.emplace_back(")");
-            newTokens.emplace_back("{");
-            conceptNames.insert(tokens[i+1]);
-            inConcept = false;
-            i += 2;
-            continue;
-        }
-        if(tokens[i]=="struct") {
-            inConcept = false;
-            if(i>=tokens.size()-3) {
-                std::cerr << "`struct` definition is incomplete" << std::endl;
-                exit(1);
-            }
-            if(tokens[i+2]!="{") {
-                std::cerr << "Invalid `struct` definition" << std::endl;
-                exit(1);
-            }
-            newTokens.emplace_back("struct");
-            newTokens.emplace_back(tokens[i+1]);
-            newTokens.emplace_back("{");
-            newTokens.emplace_back(tokens[i+1]+"* operator->() {return this;} // optimized away by -O2 \n");
-            newTokens.emplace_back("const "+tokens[i+1]+"* operator->() const {return this;} // optimized away by -O2 \n");
-            newTokens.emplace_back(tokens[i+1]+"(const "+tokens[i+1]+"& other) = default; \n");
-            newTokens.emplace_back(tokens[i+1]+"("+tokens[i+1]+"&& other) = default; \n");
-            i += 2;
-            continue;
-        }
-        if(tokens[i]=="exists") {
-            int depth = 1;
-            int pos = i+2;
-            std::string type("");
-            while(pos<tokens.size()) {
-                if(tokens[pos]=="[")
-                    depth++;
-                if(tokens[pos]=="]")
-                    depth--;
-                if(depth==0)
-                    break;
-                type += tokens[pos];
-                if(tokens[pos]=="[")
-                    depth++;
-                pos++;
-            }
-            pos++;
-
-            depth = 0;
-            newTokens.emplace_back("{ ");
-            while(pos<tokens.size()) {
-                if(tokens[pos]=="{")
-                    depth++;
-                if(tokens[pos]=="}")
-                    depth--;
-                if(tokens[pos]==";" && depth==0)
-                    break;
-                if(tokens[pos]==".")
-                    newTokens.emplace_back("->");
-                else
-                    newTokens.emplace_back(tokens[pos]);
-                pos++;
-            }
-            if(pos==tokens.size()) {
-                std::cerr << "Never terminated the `exists` statement with `;`." << std::endl;
-                exit(1);
-            }
-            newTokens.emplace_back(" }");
-            newTokens.emplace_back("->");
-            newTokens.emplace_back("std::convertible_to");
-            newTokens.emplace_back("<");
-            newTokens.emplace_back(type);
-            newTokens.emplace_back(">");
-            newTokens.emplace_back(";");
-            i = pos;
-            continue;
-        }
-        if(i<tokens.size()-9 && tokens[i]=="cimple" && tokens[i+1]=="." && tokens[i+2]=="unsafe" && tokens[i+3]=="." && tokens[i+4]=="include" && tokens[i+5]=="(") {
-            if(tokens[i+6][0]=='"')
-                preample.emplace_back("#include "+tokens[i+6]+"\n");
-            else
-                preample.emplace_back("#include <"+tokens[i+6]+">\n");
-            if(tokens[i+7]!=")" || tokens[i+8]!=";")
-                throw std::runtime_error("Invalid unsafe include syntax.");
-            i += 8;
-            continue;
-        }
-        if(i<tokens.size()-7 && tokens[i]=="cimple" && tokens[i+1]=="." && tokens[i+2]=="unsafe" && tokens[i+3]=="." && tokens[i+4]=="inline" && tokens[i+5]=="(") {
-            int depth = 1;
-            int pos = i+6;
-            while(pos<tokens.size()) {
-                if(tokens[pos]=="(")
-                    depth++;
-                if(tokens[pos]==")")
-                    depth--;
-                if(depth==0)
-                    break;
-                if(tokens[pos]=="#")
-                    throw std::runtime_error("For added safety, you cannot also not use preprocessor directives when inlining.");
-                newTokens.emplace_back(tokens[pos]);
-                pos++;
-            }
-            i = pos;
-            continue;
-        }
-        if(tokens[i]=="var") {
-            if(declaring) {
-                std::cerr << "Explicit types are always expected as function arguments." << std::endl;
-                exit(1);
-            }
-            if(i<tokens.size()-8 && tokens[i+2]=="=" && tokens[i+3]=="cimple" && tokens[i+4]==".") {
-                if(tokens[i+5]=="import" &&  tokens[i+6]=="(")  {
-                    newTokens.emplace_back("\nnamespace");
-                    newTokens.emplace_back("cimple_"+tokens[i+1]);
-                    newTokens.emplace_back("{");
-                    std::cout << transpilation_depth <<  "→ " << tokens[i+7].substr(1, tokens[i+7].find_last_of('\"')-1) << ".cm" << std::endl;
-                    //newTokens.emplace_back("#include "+tokens[i+7].substr(0, tokens[i+7].find_last_of('\"')) + ".cpp\"\n");
-                    std::ifstream infile(tokens[i + 7].substr(1, tokens[i + 7].find_last_of('\"') - 1) + ".cm");
-                    if (!infile.is_open()) {
-                        std::string filename = directory + "/" + tokens[i + 7].substr(1, tokens[i + 7].find_last_of('\"') - 1) + ".cm";
-                        infile.open(filename);
-                        if (!infile.is_open()) 
-                            throw std::runtime_error("Could not open file: " + filename);
-                    }
-                    std::stringstream buffer;
-                    buffer << infile.rdbuf();
-                    infile.close();
-                    std::vector<std::string> fileTokens = tokenize(buffer.str());
-                    std::string newDirectory = directory+tokens[i+7].substr(1, tokens[i+7].find_last_of('/'));
-                    fileTokens = transformTokens(fileTokens, false, preample, transpilation_depth+"  ", newDirectory);
-                    newTokens.insert(newTokens.end(), fileTokens.begin(), fileTokens.end());
-                    namespaces.insert(tokens[i+1]);
-                    i = i+9;
-                    newTokens.emplace_back("}");
-                    newTokens.emplace_back("\n");
-                }
-                else if(i<tokens.size()-9 && tokens[i+5]=="unsafe" && tokens[i+6]=="." && tokens[i+7]=="inline" && tokens[i+8]=="(") {
-                    newTokens.emplace_back("auto");
-                    newTokens.emplace_back(tokens[i+1]);
-                    newTokens.emplace_back("=");
-                    int depth = 1;
-                    int pos = i+9;
-                    while(pos<tokens.size()) {
-                        if(tokens[pos]=="(")
-                            depth++;
-                        if(tokens[pos]==")")
-                            depth--;
-                        if(depth==0)
-                            break;
-                        if(tokens[pos]=="#")
-                            throw std::runtime_error("For added safety, you cannot also not use preprocessor directives when inlining.");
-                        newTokens.emplace_back(tokens[pos]);
-                        pos++;
-                    }
-                    i = pos;
-                }
-                else
-                    throw std::runtime_error("Invalid instruction for cimple.");
-                continue;
-            }
-            newTokens.emplace_back("auto");
-            if(i<tokens.size()-1)
-                argNames.insert(tokens[i+1]);
-            continue;
-        }
-        if(tokens[i]=="self") {
-            if(i<tokens.size()-1 && tokens[i+1]==".") {
-                newTokens.emplace_back("this ->");
-                i += 1;
+    Module module = Parser(tokens, &locations).parseModule();
+
+    // fetch the missing dependencies of this module concurrently before any of them is imported
+    std::vector<std::pair<std::string, std::string>> dependencies;
+    for (const Decl& decl : module.decls)
+        if (decl.kind == Decl::Kind::Get)
+            dependencies.emplace_back(decl.path, decl.url);
+    packages.prefetch(dependencies);
+
+    Reachability reachable(module, tokens, used);
+    Lowering(newTokens, preample, transpilation_depth, directory, filename, locations, reachable, injectExtras).lower(module);
+    return newTokens;
+}
+
+// Attributes that start programs with the default action of SIGPIPE, so that a program whose output is a closed pipe
+// stops as it does when run from a shell, even if this process inherited SIGPIPE ignored
+struct SpawnAttributes {
+    posix_spawnattr_t attributes;
+    SpawnAttributes() {
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGPIPE);
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setsigdefault(&attributes, &defaults);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+    }
+    ~SpawnAttributes() { posix_spawnattr_destroy(&attributes); }
+};
+
+// Runs a program directly instead of through a shell, optionally sending its output to the `output` descriptor
+// and feeding `input` to its standard input through a pipe. Returns its exit status.
+int runProcess(const std::vector<std::string>& args, int output = -1, const std::string* input = nullptr) {
+    std::vector<char*> argv;
+    for (const std::string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    int pipe[2] = {-1, -1};
+    if (input && pipe2(pipe, O_CLOEXEC) != 0) {
+        std::cerr << "Could not create a pipe to " << args[0] << std::endl;
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input)
+        posix_spawn_file_actions_adddup2(&actions, pipe[0], 0);
+    if (output >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, output, 1);
+        posix_spawn_file_actions_adddup2(&actions, output, 2);
+    }
+    SpawnAttributes spawn;
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, &spawn.attributes, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (input) {
+        close(pipe[0]);
+        // a program that exits without reading all of its input must not stop this process with SIGPIPE,
+        // so the signal is blocked while writing and any that was raised is taken back before unblocking
+        sigset_t pipeSignal, previous;
+        sigemptyset(&pipeSignal);
+        sigaddset(&pipeSignal, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipeSignal, &previous);
+        bool broken = false;
+        for (size_t written = 0; !error && written < input->size();) {
+            ssize_t count = write(pipe[1], input->data() + written, input->size() - written);
+            if (count < 0 && errno == EINTR)
                 continue;
+            if (count <= 0) {
+                broken = count < 0 && errno == EPIPE;
+                break; // the program stopped reading, so let its exit status tell what happened
             }
-            else {
-                std::cerr << "`self` must be followed by `.` and cannot be returned" << std::endl;
-                exit(1);
-            }
-        }
-        if(conceptNames.find(tokens[i])!=conceptNames.end() && declaring) {
-            newTokens.push_back("const");
-            newTokens.push_back(tokens[i]);
-            newTokens.push_back("auto");
-            newTokens.push_back("&");
-            continue;
+            written += count;
         }
-        if(tokens[i]=="shared" || tokens[i]=="vector") {
-            // Start parsing the type
-            int posCopy = i;
-            bool isConstructorCall = false;
-            try {
-                std::string parsedType = parseType(tokens, posCopy, conceptNames, declaring, isConstructorCall, i-2);
-                newTokens.emplace_back(parsedType);
-                i = posCopy - 1; // Adjust for loop increment
-            }
-            catch (const std::exception& e) {
-                std::cerr << "Type parsing error at token " << i << ": " << e.what() << std::endl;
-                exit(1);
-            }
-            continue;
+        close(pipe[1]);
+        timespec now{};
+        if (broken && !sigismember(&previous, SIGPIPE))
+            sigtimedwait(&pipeSignal, nullptr, &now);
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+    if (error) {
+        std::cerr << "Could not run " << args[0] << ": " << std::strerror(error) << std::endl;
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Command line options that affect how files are built
+struct BuildOptions {
+    bool keepCpp = false; // also write the generated code to <name>.cpp when compilation succeeds
+    bool release = false; // -O3 with link-time optimization for the `march` architecture
+    bool unity = false; // release build that optimizes the program as a whole while compiling it, instead of at link time
+    std::string march = "native";
+    bool pgo = false; // release build trained on a run of the program whose standard input is `training` (if not empty)
+    std::string training;
+    bool profile = false; // times every func and method, also writing a Chrome trace to `trace` if set
+    std::string trace;
+    bool memstats = false; // counts allocations per func and type, reported at exit or by `cimple.memstats()`
+    bool watch = false; // rebuilds and reruns whenever the program's modules change, with precompiled standard headers
+
+    std::vector<std::string> flags() const {
+        if (!release && !pgo && !unity)
+            return {"-O2"};
+        // the generated code is a single translation unit, so telling the compiler that it is the whole program
+        // internalizes and inlines across modules as LTO does, without a link-time pass
+        std::vector<std::string> flags = {"-O3", unity ? "-fwhole-program" : "-flto=auto"};
+        if (march.size())
+            flags.push_back("-march=" + march);
+        return flags;
+    }
+};
+
+// Reads `[options] <source.cm>`, returning false on unknown options or a missing file.
+bool parseOptions(const std::vector<std::string>& args, BuildOptions& options, std::string& filename) {
+    filename = "";
+    for (const std::string& arg : args) {
+        if (arg == "--keep-cpp")
+            options.keepCpp = true;
+        else if (arg == "--release")
+            options.release = true;
+        else if (arg == "--unity")
+            options.unity = true;
+        else if (arg.substr(0, 8) == "--march=")
+            options.march = arg.substr(8);
+        else if (arg == "--pgo" || arg.substr(0, 6) == "--pgo=") {
+            options.pgo = true;
+            options.training = arg.size() > 6 ? arg.substr(6) : "";
         }
-        if(declaring 
-            && tokens[i]!="," 
-            && tokens[i]!="("  
-            && tokens[i]!=")" 
-            && primitiveTypes.find(tokens[i]) == primitiveTypes.end()
-            && i<tokens.size()-1 && tokens[i+1]!="," && tokens[i+1]!="=" && tokens[i+1]!=")"
-            && i && tokens[i-1]!="=") {
-            //newTokens.emplace_back("const");
-            newTokens.emplace_back(tokens[i]);
-            newTokens.emplace_back("&");
-            continue;
+        else if (arg == "--memstats")
+            options.memstats = true;
+        else if (arg == "--watch")
+            options.watch = true;
+        else if (arg == "--profile" || arg.substr(0, 10) == "--profile=") {
+            options.profile = true;
+            options.trace = arg.size() > 10 ? arg.substr(10) : "";
         }
-        /*if(declaring && (tokens[i]=="," || (tokens[i]==")" && tokens[i-1]!="("))) {
-            // Continue to next token
-            newTokens.emplace_back(";");
-            newTokens.emplace_back(tokens[i]);
-            continue;
-        }*/
+        else if (arg.size() && arg[0] == '-')
+            return false;
+        else if (filename.empty())
+            filename = arg;
+        else
+            return false;
+    }
+    return !filename.empty();
+}
 
-        // Replace 'string' with 'std::string' and 'boolean' with 'bool'
-        //if(tokens[i]=="string") {
-        //    newTokens.emplace_back("std::string");
-        //    continue;
-        //}
+// Hash of the code each executable was last compiled from, so that the compile server skips unchanged programs
+static std::unordered_map<std::string, std::string> compiledCode;
 
-        newTokens.emplace_back(tokens[i]);
-    }
+// Pipes the generated code to g++ to produce `executable_name`
+bool compileCode(const std::string& code, const std::string& executable_name, const std::vector<std::string>& flags, int output) {
+    std::vector<std::string> args = {"g++", "-x", "c++", "-", "-o", executable_name, "-std=c++23", "-I" + installDirectory()};
+    args.insert(args.end(), flags.begin(), flags.end());
+    return runProcess(args, output, &code) == 0;
+}
 
-    return std::move(newTokens);
+// Precompiles `header`, the standard headers that the runtime includes, into the package store for the given compiler
+// flags. Returns the header to include first, or nothing if it cannot be precompiled. Parsing these headers takes most
+// of the time that compiling a program does.
+std::string precompiledHeader(const std::string& header, const std::vector<std::string>& flags) {
+    std::string key = header;
+    for (const std::string& flag : flags)
+        key += " " + flag;
+    std::string directory = packages.directory() + "/pch";
+    std::string path = directory + "/" + content_hash(key) + ".h";
+    if (access((path + ".gch").c_str(), R_OK) == 0)
+        return path;
+    std::cout << "  Precompiling: standard headers" << std::endl;
+    make_directories(directory);
+    std::vector<std::string> args = {"g++", "-x", "c++-header", path, "-o", path + ".gch.tmp", "-std=c++23"};
+    args.insert(args.end(), flags.begin(), flags.end());
+    if (!write_file(path, header) || runProcess(args) != 0 || std::rename((path + ".gch.tmp").c_str(), (path + ".gch").c_str()) != 0) {
+        std::remove((path + ".gch.tmp").c_str());
+        return "";
+    }
+    return path;
 }
 
-void processFile(const std::string& filename) {
-    std::ifstream infile(filename);
-    if (!infile.is_open()) {
+bool buildFile(const std::string& filename, const BuildOptions& options, std::string& executable_name, int output = -1) {
+    std::vector<std::string> tokens;
+    std::vector<Location> locations;
+    loadedFiles.clear();
+    if (!loadTokens(filename, tokens, locations)) {
         std::cerr << "Could not open file: " << filename << std::endl;
-        return;
+        return false;
     }
 
-    std::stringstream buffer;
-    buffer << infile.rdbuf();
-    infile.close();
-
-    std::vector<std::string> tokens = tokenize(buffer.str());
     std::cout << "  Building: " << filename << std::endl;
+    packages.open();
     std::vector<std::string> preample;
-    tokens = transformTokens(tokens, true, preample, "    ", filename.substr(0, filename.find_last_of('/')));
+    profiling = options.profile;
+    profileTrace = options.trace;
+    memoryStats = options.memstats;
+    tokens = transformTokens(tokens, locations, true, preample, "    ", filename.substr(0, filename.find_last_of('/')), filename);
+    std::string header; // the runtime's own #include <...> lines, as the preample only holds those of modules
+    if (options.watch)
+        for (const std::string& token : tokens)
+            for (size_t at = token.find("#include <"); at != std::string::npos; at = token.find("#include <", at + 1))
+                header += token.substr(at, token.find('\n', at) - at) + "\n";
     tokens.insert(tokens.begin(), preample.begin(), preample.end());
 
+    // the code goes straight from this buffer to the compiler; it is only written to disk with --keep-cpp or when compilation fails
     std::string output_filename = filename.substr(0, filename.find_last_of('.')) + ".cpp";
-    std::ofstream outfile(output_filename);
-    if (!outfile.is_open()) {
-        std::cerr << "Could not open file for writing: " << output_filename << std::endl;
-        return;
-    }
+    std::string code = "#line 1 \"" + escape(output_filename) + "\"\n";
+    size_t size = code.size();
+    for (const std::string& token : tokens)
+        size += token.size() + 4;
+    code.reserve(size);
     std::string prefix("");
-    for (int i=0;i<tokens.size()-1;++i) {
+    for (size_t i = 0; i + 1 < tokens.size(); ++i) {
         std::string& token = tokens[i];
         std::string& nextToken = tokens[i+1];
-        outfile << token;
+        code += token;
         if(token.size()>1 && nextToken.size()>1)
-            outfile << ' ';
+            code += ' ';
         else if(token.size()==0 || nextToken.size()==0) {}
         else if(std::isalnum(static_cast<unsigned char>(token[0])) && std::isalnum(static_cast<unsigned char>(nextToken[0])))
-            outfile << ' ';
+            code += ' ';
         if(token.size() && token[token.size()-1]=='{')
             prefix += "   ";
         if(token.size() && (token[token.size()-1]=='{' || token[0]=='}' || token[token.size()-1]==';' || token[0]=='#')) {
-            outfile << '\n';
+            code += '\n';
             if(nextToken.size() && nextToken[0]=='}') {
                 if (prefix.size() >= 3)
                     prefix.resize(prefix.size() - 3);
             }
-            outfile << prefix;
+            code += prefix;
         }
         else if(token.size() && token[token.size()-1]=='\n') {
             if(prefix.size())
-                outfile << prefix.substr(1);
+                code += prefix.substr(1);
         }
     }
     if (!tokens.empty())
-        outfile << tokens.back();
+        code += tokens.back();
 
-    outfile.close();
-    std::cout << "  Compiling: " << output_filename << std::endl;
+    executable_name = filename.substr(0, filename.find_last_of('.'));
+    char path[PATH_MAX];
+    std::string key = realpath(filename.c_str(), path) ? std::string(path) : filename;
+    std::vector<std::string> flags = options.flags();
+    std::string hash = content_hash(code);
+    for (const std::string& flag : flags)
+        hash = content_hash(hash + " " + flag);
+    // the training input is part of the key by content, so that editing it trains the program again
+    std::string input;
+    if (options.pgo && options.training.size() && !read_file(options.training, input))
+        throw std::runtime_error("Could not open training input: " + options.training);
+    if (options.pgo)
+        hash = content_hash(hash + " --pgo=" + content_hash(input));
+    if (compiledCode[key] == hash && access(executable_name.c_str(), X_OK) == 0) {
+        std::cout << "  Compiling: " << output_filename << " (unchanged)" << std::endl;
+        return true;
+    }
 
-    std::string executable_name = filename.substr(0, filename.find_last_of('.'));
-    std::string compile_command = "g++ " + output_filename + " -o "+executable_name+" -O2 -std=c++23";
-    if (std::system(compile_command.c_str()) != 0) 
+    std::cout << "  Compiling: " << output_filename << std::endl;
+    if (options.watch && !options.pgo) {
+        std::string precompiled = precompiledHeader(header, flags);
+        if (precompiled.size())
+            flags.insert(flags.end(), {"-include", precompiled});
+    }
+    bool compiled = true;
+    bool profiled = true; // false after a failed training run, whose build is done again next time
+    if (options.pgo) {
+        // profiles are cached by code, flags and executable path, the latter because gcc names .gcda files after the output
+        std::string profile = packages.directory() + "/profiles/" + content_hash(hash + " " + key);
+        std::string trained = profile + "/trained";
+        profiled = access(trained.c_str(), R_OK) == 0;
+        if (!profiled) {
+            remove_directory(profile); // what an interrupted training run left
+            make_directories(profile);
+            std::vector<std::string> instrumented = flags;
+            instrumented.insert(instrumented.end(), {"-fprofile-generate", "-fprofile-update=atomic", "-fprofile-dir=" + profile});
+            compiled = compileCode(code, executable_name, instrumented, output);
+            if (compiled) {
+                std::string run_command = executable_name[0]=='/' ? executable_name : "./" + executable_name;
+                std::cout << "  Training: " << run_command << (options.training.size() ? " < " + options.training : "") << std::endl;
+                // only finished training runs are kept, so that a failed one is not taken for a profile by later builds
+                profiled = runProcess({run_command}, output, &input) == 0;
+                if (profiled) {
+                    write_file(trained, options.training + "\n");
+                    std::cout << "  Compiling: " << output_filename << " (with profile)" << std::endl;
+                }
+                else {
+                    remove_directory(profile);
+                    std::cerr << "The training run failed, so the program is compiled without a profile." << std::endl;
+                }
+            }
+        }
+        if (profiled)
+            flags.insert(flags.end(), {"-fprofile-use", "-fprofile-dir=" + profile});
+    }
+    compiled = compiled && compileCode(code, executable_name, flags, output);
+    if (!compiled || options.keepCpp) {
+        std::ofstream outfile(output_filename);
+        if (!outfile.is_open()) 
+            std::cerr << "Could not open file for writing: " << output_filename << std::endl;
+        outfile << std::string_view(code).substr(code.find('\n') + 1);
+    }
+    if (!compiled) {
         std::cerr << "Failed to compile the generated code." << std::endl;
-    std::string run_command = "./" + executable_name;
+        compiledCode.erase(key);
+        return false;
+    }
+    if (profiled)
+        compiledCode[key] = hash;
+    else
+        compiledCode.erase(key);
+    return true;
+}
+
+// Builds and runs `filename` whenever it or a module that it imports is saved, stopping the previous run if it is still going.
+// Imports that did not change are not lowered again, and the standard headers are only compiled once.
+int watchFile(const std::string& filename, const BuildOptions& options) {
+    int notify = inotify_init1(IN_CLOEXEC);
+    if (notify < 0) {
+        std::cerr << "Could not watch files: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::unordered_map<int, std::string> directories; // watched directory of each watch descriptor
+    while (true) {
+        std::string executable_name;
+        pid_t program = -1;
+        try {
+            if (buildFile(filename, options, executable_name)) {
+                std::string run_command = executable_name[0]=='/' ? executable_name : "./" + executable_name;
+                std::cout << "  Running: " << run_command << std::endl;
+                std::cout << "--------------------------------------------" << std::endl;
+                char* argv[] = {const_cast<char*>(run_command.c_str()), nullptr};
+                SpawnAttributes spawn;
+                if (posix_spawnp(&program, argv[0], nullptr, &spawn.attributes, argv, environ) != 0) {
+                    std::cerr << "Could not run " << run_command << std::endl;
+                    program = -1;
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+
+        // editors often save by renaming a new file over the old one, so the directories are watched instead of the files
+        char path[PATH_MAX];
+        std::unordered_set<std::string> files(loadedFiles.begin(), loadedFiles.end());
+        if (realpath(filename.c_str(), path))
+            files.insert(path);
+        for (const std::string& file : files) {
+            std::string directory = file.substr(0, file.find_last_of('/'));
+            int watch = inotify_add_watch(notify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (watch >= 0)
+                directories[watch] = directory;
+        }
+        if (program < 0)
+            std::cout << "  Watching: " << files.size() << " files (Ctrl+C to stop)" << std::endl;
+
+        alignas(inotify_event) char events[4096];
+        for (bool changed = false; !changed;) {
+            pollfd ready = {notify, POLLIN, 0};
+            int count = poll(&ready, 1, program > 0 ? 100 : -1);
+            int status;
+            if (program > 0 && waitpid(program, &status, WNOHANG) == program) {
+                program = -1;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    std::cerr << "Failed to run the generated code." << std::endl;
+                std::cout << "--------------------------------------------" << std::endl;
+                std::cout << "  Watching: " << files.size() << " files (Ctrl+C to stop)" << std::endl;
+            }
+            if (count <= 0)
+                continue;
+            ssize_t size = read(notify, events, sizeof(events));
+            for (ssize_t at = 0; at < size;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(events + at);
+                at += sizeof(inotify_event) + event->len;
+                if (!event->len || !files.count(directories[event->wd] + "/" + event->name))
+                    continue;
+                if (!changed)
+                    std::cout << "  Changed: " << directories[event->wd] << "/" << event->name << std::endl;
+                changed = true;
+            }
+        }
+        if (program > 0) {
+            kill(program, SIGTERM);
+            waitpid(program, nullptr, 0);
+            std::cout << "--------------------------------------------" << std::endl;
+        }
+        // editors may write several files at once, which are all picked up by a single rebuild
+        for (pollfd ready = {notify, POLLIN, 0}; poll(&ready, 1, 50) > 0;)
+            if (read(notify, events, sizeof(events)) <= 0)
+                break;
+    }
+}
+
+void runFile(const std::string& executable_name) {
+    std::string run_command = executable_name[0]=='/' ? executable_name : "./" + executable_name;
     std::cout << "  Running: " << run_command << std::endl;
     std::cout << "--------------------------------------------" << std::endl;
-    if (std::system(run_command.c_str()) != 0) 
+    if (runProcess({run_command}) != 0) 
         std::cerr << "Failed to run the generated code." << std::endl;
     //else
     //    std::cout << "Execution finished" << std::endl;
+}
+
+void processFile(const std::string& filename, const BuildOptions& options) {
+    std::string executable_name;
+    if (buildFile(filename, options, executable_name))
+        runFile(executable_name);
+}
+
+// One line of the results that bench blocks write, which is also the format of saved baselines
+struct BenchResult {
+    std::string name;
+    size_t iterations = 0;
+    double mean = 0;
+    double median = 0;
+    double p99 = 0;
+};
+
+std::vector<BenchResult> parseBenchResults(const std::string& content) {
+    std::vector<BenchResult> results;
+    std::istringstream lines(content);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t at = line.find("{\"name\": \"");
+        if (at == std::string::npos)
+            continue;
+        BenchResult result;
+        for (at += 10; at < line.size() && line[at] != '"'; ++at) {
+            if (line[at] == '\\' && at + 1 < line.size())
+                ++at;
+            result.name += line[at];
+        }
+        auto number = [&](const std::string& key) {
+            size_t found = line.find("\"" + key + "\": ", at);
+            return found == std::string::npos ? 0.0 : std::strtod(line.c_str() + found + key.size() + 4, nullptr);
+        };
+        result.iterations = static_cast<size_t>(number("iterations"));
+        result.mean = number("mean");
+        result.median = number("median");
+        result.p99 = number("p99");
+        results.push_back(result);
+    }
+    return results;
+}
+
+// Builds `filename` in release mode, runs its bench blocks and compares their mean times with the baseline saved
+// next to it in <name>.bench.json, which `save` replaces with the new results.
+int benchFile(const std::string& filename, BuildOptions options, bool save) {
+    options.release = true;
+    std::string executable_name;
+    if (!buildFile(filename, options, executable_name))
+        return 1;
+    std::string run_command = executable_name[0]=='/' ? executable_name : "./" + executable_name;
+    std::string resultsFile = executable_name + ".bench.tmp";
+    std::string baselineFile = filename.substr(0, filename.find_last_of('.')) + ".bench.json";
+    std::cout << "  Benchmarking: " << run_command << std::endl;
+    std::cout << "--------------------------------------------" << std::endl;
+    setenv("CIMPLE_BENCH", resultsFile.c_str(), 1);
+    int status = runProcess({run_command});
+    unsetenv("CIMPLE_BENCH");
+    std::string content;
+    bool written = read_file(resultsFile, content);
+    std::remove(resultsFile.c_str());
+    if (status != 0 || !written) {
+        std::cerr << "Failed to run the benchmarks." << std::endl;
+        return 1;
+    }
+    std::vector<BenchResult> results = parseBenchResults(content);
+    if (results.empty()) {
+        std::cerr << "No `bench \"name\" {...}` blocks in " << filename << std::endl;
+        return 1;
+    }
+    std::string saved;
+    std::vector<BenchResult> baseline = read_file(baselineFile, saved) ? parseBenchResults(saved) : std::vector<BenchResult>();
+
+    char row[256];
+    std::snprintf(row, sizeof(row), "%-28s %14s %14s %14s %12s %10s", "benchmark", "mean", "median", "p99", "iterations", "baseline");
+    std::cout << row << std::endl;
+    for (const BenchResult& result : results) {
+        std::string change = "-";
+        for (const BenchResult& previous : baseline)
+            if (previous.name == result.name && previous.mean > 0) {
+                char percent[32];
+                std::snprintf(percent, sizeof(percent), "%+.1f%%", (result.mean / previous.mean - 1) * 100);
+                change = percent;
+            }
+        std::snprintf(row, sizeof(row), "%-28s %11.2f ns %11.2f ns %11.2f ns %12zu %10s", result.name.c_str(),
+                      result.mean, result.median, result.p99, result.iterations, change.c_str());
+        std::cout << row << std::endl;
+    }
+    // a block named "<name>/c++" is the hand-written reference of block "<name>", as in bench/overhead.cm
+    bool header = false;
+    for (const BenchResult& result : results)
+        for (const BenchResult& reference : results)
+            if (reference.name == result.name + "/c++" && reference.median > 0) {
+                if (!header)
+                    std::cout << "Slowdown against hand-written C++ (median):" << std::endl;
+                header = true;
+                std::snprintf(row, sizeof(row), "%-28s %13.2fx", result.name.c_str(), result.median / reference.median);
+                std::cout << row << std::endl;
+            }
+    if (save) {
+        if (!write_file(baselineFile, content)) {
+            std::cerr << "Could not write " << baselineFile << std::endl;
+            return 1;
+        }
+        std::cout << "Saved the baseline to " << baselineFile << std::endl;
+    }
+    return 0;
+}
+
+// Unbuffered stream into a socket, so that the compile server's messages and the compiler's output reach the client in order.
+// Writes to a peer that went away fail instead of raising SIGPIPE.
+class DescriptorBuffer : public std::streambuf {
+public:
+    explicit DescriptorBuffer(int fd) : fd(fd) {}
+protected:
+    int overflow(int c) override {
+        char character = c;
+        return c == EOF || xsputn(&character, 1) == 1 ? c : EOF;
+    }
+    std::streamsize xsputn(const char* text, std::streamsize count) override {
+        for (std::streamsize written = 0; written < count;) {
+            ssize_t result = send(fd, text + written, count - written, MSG_NOSIGNAL);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return written;
+            written += result;
+        }
+        return count;
+    }
+private:
+    int fd;
+};
+
+// Identifies this build of cimple to the compile server, which only serves clients built from the same code,
+// since another build may emit another runtime or lower code differently
+const std::string buildIdentity = std::string("cimple v0.1 ") + __DATE__ + " " + __TIME__;
+
+std::string serverSocket() {
+    const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+        return std::string(runtime) + "/cimple.sock";
+    return "/tmp/cimple-" + std::to_string(getuid()) + "/server.sock";
+}
+
+std::string socketDirectory(const std::string& socketPath) {
+    size_t slash = socketPath.find_last_of('/');
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : socketPath.substr(0, slash);
+}
 
+// Whether `path` is a directory of this user with mode 0700, so that no other user can put a socket in it or connect to one there
+bool privateDirectory(const std::string& path) {
+    struct stat info;
+    return lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == getuid() && (info.st_mode & 07777) == 0700;
+}
+
+// Whether the process at the other end of a Unix socket runs as this user
+bool sameUser(int socket) {
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    return getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && length == sizeof(credentials)
+        && credentials.uid == getuid();
+}
+
+// Compile server: builds the files that clients send over a Unix socket with modules and compiled programs kept warm.
+// A request is the client's buildIdentity, working directory and command line arguments on separate lines. The reply is the build's
+// output, then a null character and the executable to run (empty if the build failed). Clients run the executable themselves.
+// Clients of another build get a single \1 character instead, and build by themselves. The socket must be in a directory
+// that only this user can use, and both ends check that the other runs as the same user, since builds run arbitrary code.
+int serve(const std::string& socketPath) {
+    std::string directory = socketDirectory(socketPath);
+    mkdir(directory.c_str(), 0700); // the default directory under /tmp is created on first use
+    if (!privateDirectory(directory)) {
+        std::cerr << "Not serving builds at " << socketPath << ", since " << directory
+                  << " must belong to this user with mode 0700." << std::endl;
+        return 1;
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    unlink(socketPath.c_str());
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(server, 64) != 0) {
+        std::cerr << "Could not serve builds at: " << socketPath << std::endl;
+        return 1;
+    }
+    std::cout << "  Serving builds at: " << socketPath << std::endl;
+    while (true) {
+        int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+        if (!sameUser(client)) {
+            std::cout << "  Refused a build from another user" << std::endl;
+            close(client);
+            continue;
+        }
+        // clients send their whole request at once, so one that stops sending before shutting down its end is dropped
+        // instead of holding up the builds of others
+        timeval timeout{5, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char chunk[4096];
+        ssize_t count;
+        while ((count = read(client, chunk, sizeof(chunk))) > 0 || (count < 0 && errno == EINTR))
+            if (count > 0)
+                request.append(chunk, count);
+        if (count < 0) {
+            std::cout << "  Dropped a client that did not finish its request" << std::endl;
+            close(client);
+            continue;
+        }
+        std::vector<std::string> lines;
+        std::istringstream fields(request);
+        for (std::string line; std::getline(fields, line);)
+            lines.push_back(line);
+        if (lines.empty() || lines[0] != buildIdentity) {
+            std::cout << "  Refused a build from another version of cimple" << std::endl;
+            send(client, "\1", 1, MSG_NOSIGNAL);
+            close(client);
+            continue;
+        }
+        lines.erase(lines.begin());
+        BuildOptions options;
+        std::string filename;
+        std::string executable_name;
+        bool built = false;
+        DescriptorBuffer stream(client);
+        std::streambuf* out = std::cout.rdbuf(&stream);
+        std::streambuf* err = std::cerr.rdbuf(&stream);
+        try {
+            if (lines.empty() || chdir(lines[0].c_str()) != 0 || !parseOptions(std::vector<std::string>(lines.begin() + 1, lines.end()), options, filename))
+                std::cerr << "Invalid build request." << std::endl;
+            else
+                built = buildFile(filename, options, executable_name, client);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+        std::cout.rdbuf(out);
+        std::cerr.rdbuf(err);
+        std::string reply = std::string(1, '\0') + (built ? executable_name : "");
+        stream.sputn(reply.data(), reply.size());
+        close(client);
+    }
+}
+
+// Sends the build to a running compile server. Returns false if none is listening, in which case the caller builds by itself.
+// Servers whose socket another user could have put in place, or that run as another user, are not trusted with the build.
+bool buildRemotely(const std::string& socketPath, const std::vector<std::string>& args, std::string& executable_name, bool& built) {
+    struct stat info;
+    if (lstat(socketPath.c_str(), &info) != 0)
+        return false;
+    if (!S_ISSOCK(info.st_mode) || info.st_uid != getuid() || !privateDirectory(socketDirectory(socketPath))) {
+        std::cout << "  Not using the compile server at " << socketPath << ", since it and its directory must belong to this user"
+                  << " and the directory must have mode 0700." << std::endl;
+        return false;
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    if (server < 0 || connect(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        if (server >= 0)
+            close(server);
+        return false;
+    }
+    if (!sameUser(server)) {
+        std::cout << "  Not using the compile server at " << socketPath << ", which runs as another user." << std::endl;
+        close(server);
+        return false;
+    }
+    char directory[PATH_MAX];
+    std::string request = buildIdentity + "\n" + (getcwd(directory, sizeof(directory)) ? directory : ".");
+    for (const std::string& arg : args)
+        request += "\n" + arg;
+    DescriptorBuffer stream(server);
+    stream.sputn(request.data(), request.size());
+    shutdown(server, SHUT_WR);
+    std::cout.flush();
+    std::string reply;
+    char chunk[4096];
+    ssize_t count;
+    bool finished = false;
+    bool started = false;
+    while ((count = read(server, chunk, sizeof(chunk))) > 0) {
+        if (!started && chunk[0] == '\1') {
+            std::cout << "  Not using the compile server at " << socketPath << ", which runs another version of cimple. Restart it with `cimple --server`." << std::endl;
+            close(server);
+            return false;
+        }
+        started = true;
+        if (finished) {
+            reply.append(chunk, count);
+            continue;
+        }
+        char* end = static_cast<char*>(std::memchr(chunk, '\0', count));
+        std::cout.write(chunk, end ? end - chunk : count);
+        if (end) {
+            finished = true;
+            reply.append(end + 1, chunk + count - end - 1);
+        }
+    }
+    close(server);
+    std::cout.flush();
+    built = finished && !reply.empty();
+    executable_name = reply;
+    if (!finished)
+        std::cerr << "The compile server stopped before finishing the build." << std::endl;
+    return true;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <source.cm>" << std::endl;
+    std::vector<std::string> args(argv + 1, argv + argc);
+    BuildOptions options;
+    std::string filename;
+    bool serving = args.size() && args[0] == "--server";
+    bool benchmarking = args.size() && args[0] == "bench";
+    bool save = false;
+    if (benchmarking) {
+        args.erase(args.begin());
+        auto found = std::find(args.begin(), args.end(), "--save");
+        save = found != args.end();
+        if (save)
+            args.erase(found);
+    }
+    if ((serving && args.size() > 2) || (!serving && !parseOptions(args, options, filename))) {
+        std::cerr << "Usage: " << argv[0] << " [--keep-cpp] [--release] [--unity] [--march=<arch>] [--pgo[=<training input>]] [--profile[=<trace.json>]] [--memstats] [--watch] <source.cm>" << std::endl;
+        std::cerr << "       " << argv[0] << " bench [--save] [--unity] [--keep-cpp] [--march=<arch>] [--pgo[=<training input>]] <source.cm>" << std::endl;
+        std::cerr << "       " << argv[0] << " --server [socket]" << std::endl;
         return 1;
     }
     std::cout << "--------------- Cimple v0.1 ----------------" << std::endl;
-    processFile(argv[1]);
+    if (serving)
+        return serve(args.size() == 2 ? args[1] : serverSocket());
+    try {
+        if (benchmarking)
+            return benchFile(filename, options, save);
+        if (options.watch)
+            return watchFile(filename, options);
+        std::string executable_name;
+        bool built = false;
+        if (!buildRemotely(serverSocket(), args, executable_name, built))
+            processFile(filename, options);
+        else if (built)
+            runFile(executable_name);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
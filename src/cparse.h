@@ -0,0 +1,911 @@
+#ifndef CIMPLE_CPARSE_H
+#define CIMPLE_CPARSE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <unordered_set>
+#include <cctype>
+#include <cstdint>
+
+// Abstract syntax tree of a cimple module. The parser only captures structure; all C++ specifics
+// (handler templates, `->` access, namespaces of imports) are decided when the tree is lowered.
+// Every node records the position of its first token in the module's token stream.
+
+// Line and column of a token in its source file, both counted from 1
+struct Location {
+    uint32_t line = 0;
+    uint32_t column = 0;
+};
+
+struct Type {
+    std::string name;              // base name (dotted for types of imported modules), or `vector`, `shared`, `map` or `gen`
+    std::unique_ptr<Type> element; // element type of handlers and generators, or the key type of maps
+    std::unique_ptr<Type> value;   // value type of maps
+};
+
+struct Expr;
+using ExprPtr = std::unique_ptr<Expr>;
+
+struct Expr {
+    enum class Kind {
+        Name,    // text
+        Number,  // text
+        String,  // text, with quotes
+        Char,    // text, with quotes
+        Member,  // items[0].text
+        Call,    // items[0](items[1], ...)
+        Index,   // items[0][items[1]]
+        Unary,   // text items[0]
+        Postfix, // items[0] text
+        Binary,  // items[0] text items[1]
+        Assign,  // items[0] text items[1], where text is `=` or a compound assignment
+        Handler, // type, such as vector[double], map[int, double] or shared[Number]
+        List,    // {items...}
+        Paren,   // (items[0])
+        Operator, // text, a binary operator passed as a function, as in map(zip(x, y), +)
+        Inline   // raw C++ tokens of cimple.unsafe.inline(...)
+    };
+    Kind kind;
+    size_t position = 0;
+    std::string text;
+    std::vector<ExprPtr> items;
+    std::unique_ptr<Type> type;
+    std::vector<std::string> raw;
+};
+
+struct Stmt;
+using StmtPtr = std::unique_ptr<Stmt>;
+
+struct Stmt {
+    enum class Kind {
+        Block,    // body
+        Expr,     // value;
+        Var,      // var name = value;
+        Declare,  // type name = value; or type name(arguments);
+        If,       // if (value) body[0] else body[1]
+        While,    // while (value) body[0]
+        DoWhile,  // do body[0] while (value);
+        For,      // for (init; value; steps) body[0]
+        ForIn,    // for (var names in value) body[0]
+        Return,   // return value;
+        Break,
+        Continue,
+        Try,      // try body[0] catch (catches[i]) body[i+1]
+        Unbind,   // unbind value;
+        Yield,    // yield value;
+        Inline,   // cimple.unsafe.inline(raw);
+        Empty
+    };
+    Kind kind;
+    size_t position = 0;
+    std::string name;
+    std::vector<std::string> names; // ForIn: loop variables, written as [a, b] when `binding`
+    bool binding = false;
+    bool comptime = false;          // Var: written as `comptime var`, so the value is computed by the compiler
+    std::unique_ptr<Type> type;
+    ExprPtr value;
+    std::vector<ExprPtr> arguments; // Declare with constructor arguments
+    bool constructed = false;
+    StmtPtr init;
+    std::vector<ExprPtr> steps;
+    std::vector<StmtPtr> body;
+    std::vector<std::vector<std::string>> catches;
+    std::vector<std::string> raw;
+};
+
+struct Param {
+    Type type;
+    std::string name;
+};
+
+struct Func {
+    size_t position = 0;
+    std::string name;
+    bool declared = false;       // written as `func`, so the result type is inferred
+    bool generator = false;      // written as `gen[result]`, so it yields values of the result type
+    bool comptime = false;       // written as `comptime func`, so it can run at compile time
+    bool constructor = false;
+    std::unique_ptr<Type> result; // explicit result type of C++-style methods, or the yielded type of generators
+    std::vector<Param> params;
+    std::vector<StmtPtr> body;
+};
+
+struct Member {
+    StmtPtr field;               // a Declare statement
+    std::unique_ptr<Func> method;
+};
+
+struct Requirement {
+    std::unique_ptr<Type> type;  // exists[type] value; or just value; when empty
+    ExprPtr value;
+};
+
+struct Decl {
+    enum class Kind {
+        Func,      // func
+        Struct,    // name { members }
+        Concept,   // type name { requirements }
+        Import,    // var name = cimple.import(path);
+        Include,   // cimple.unsafe.include(path);
+        Get,       // cimple.get(path, url);
+        Bench,     // bench "name" { func.body }, measured by `cimple bench`
+        Statement  // statement
+    };
+    Kind kind;
+    size_t position = 0;
+    std::string name;
+    std::string path;
+    std::string url;
+    std::unique_ptr<Func> func;
+    std::vector<Member> members;
+    std::vector<Requirement> requirements;
+    StmtPtr statement;
+};
+
+struct Module {
+    std::vector<Decl> decls;
+};
+
+// Recursive descent parser that reads each token once, so parsing time is linear in the size of the module.
+class Parser {
+public:
+    // `locations` holds the source location of each token, if known, for error messages
+    explicit Parser(const std::vector<std::string>& tokens, const std::vector<Location>* locations = nullptr) : tokens(tokens), locations(locations) {}
+
+    Module parseModule() {
+        Module module;
+        while (pos < tokens.size())
+            module.decls.push_back(parseDecl());
+        return module;
+    }
+
+private:
+    const std::vector<std::string>& tokens;
+    const std::vector<Location>* locations;
+    size_t pos = 0;
+
+    static const std::unordered_set<std::string>& keywords() {
+        static const std::unordered_set<std::string> words = {
+            "func", "struct", "type", "var", "if", "else", "for", "while", "do", "return", "break", "continue",
+            "try", "catch", "in", "unbind", "exists", "vector", "shared", "gen", "yield", "comptime"};
+        return words;
+    }
+
+    const std::string& peek(size_t offset = 0) const {
+        static const std::string end;
+        return pos + offset < tokens.size() ? tokens[pos + offset] : end;
+    }
+    bool at(std::string_view token, size_t offset = 0) const { return peek(offset) == token; }
+    bool done() const { return pos >= tokens.size(); }
+
+    [[noreturn]] void fail(const std::string& message) const {
+        if (done())
+            throw std::runtime_error(message + " at the end of the file.");
+        if (locations && pos < locations->size())
+            throw std::runtime_error(message + " (found `" + peek() + "` at line " + std::to_string((*locations)[pos].line)
+                                     + ", column " + std::to_string((*locations)[pos].column) + ").");
+        throw std::runtime_error(message + " (found `" + peek() + "` at token " + std::to_string(pos) + ").");
+    }
+    void expect(std::string_view token) {
+        if (!at(token)) {
+            peekOperator(); // explains misplaced C++ operators
+            fail("Expected `" + std::string(token) + "`");
+        }
+        ++pos;
+    }
+    static bool isIdentifier(const std::string& token) {
+        if (token.empty() || !(std::isalpha(static_cast<unsigned char>(token[0])) || token[0] == '_'))
+            return false;
+        for (char c : token)
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+                return false;
+        return true;
+    }
+    bool atName(size_t offset = 0) const { return isIdentifier(peek(offset)) && !keywords().count(peek(offset)); }
+    std::string name() {
+        if (!atName())
+            fail("Expected a name");
+        check(peek());
+        return tokens[pos++];
+    }
+
+    // Rejects the C++ features that cimple handles by itself.
+    void check(const std::string& token) const {
+        if (token == "auto") throw std::runtime_error("`auto` is not allowed. Use `var` to declare variables or `fn` to declare functions.");
+        if (token == "void") throw std::runtime_error("`void` is not allowed.");
+        if (token == "delete") throw std::runtime_error("`delete` is not allowed. Use `unbind` to let the memory handler process how the value should best be removed from this context.");
+        if (token == "nullptr") throw std::runtime_error("`nullptr` is not allowed. If you are trying to do `varname=nullptr;`, you may consider `unbind varname;` instead to let the memory handler process how the value should best be removed from this context.");
+        if (token == "this") throw std::runtime_error("`this` is not allowed. Use `self.` (note the fullstop) to access the struct's own fields.");
+        if (token == "class") throw std::runtime_error("`class` is not allowed. Use `struct` instead.");
+        if (token == "const") throw std::runtime_error("`const` is not allowed as it is automatically applied.");
+        if (token == "begin") throw std::runtime_error("`begin` is not allowed as it is unsage and thus automatically applied when safeguards can be obtained");
+        if (token == "end") throw std::runtime_error("`end` is not allowed as it is unsage and thus automatically applied when safeguards can be obtained.");
+        if (token == "new") throw std::runtime_error("`new` is not allowed unless in the pattern handler.new(constuctor arguments).");
+        if (token.size() && token[0] == '#') throw std::runtime_error("Preprocessor directives are not allowed.");
+    }
+
+    // Operators are split into single characters by the tokenizer, so join them back here.
+    std::string peekOperator() const {
+        static const std::unordered_set<std::string> pairs = {
+            "==", "!=", "<=", ">=", "+=", "-=", "*=", "/=", "%=", "|=", "^=", "++", "--", "&&", "||", "<<", ">>"};
+        const std::string& first = peek();
+        if (first.size() != 1 || std::isalnum(static_cast<unsigned char>(first[0])) || first[0] == '"')
+            return first;
+        if (first == "-" && at(">", 1))
+            throw std::runtime_error("`->` is not allowed, as it is automatically inferred. Use `.` instead.");
+        if (first == ":")
+            throw std::runtime_error("`:` is not a valid syntax. Use `in` instead if you are in a for loop.");
+        std::string pair = first + peek(1);
+        if (peek(1).size() == 1 && pairs.count(pair)) {
+            if ((pair == "<<" || pair == ">>") && at("=", 2))
+                return pair + "=";
+            return pair;
+        }
+        if (first == "&")
+            throw std::runtime_error("`&` is not allowed. Construct `shared[type]` objects");
+        return first;
+    }
+    void skipOperator(const std::string& op) {
+        pos += std::isalpha(static_cast<unsigned char>(op[0])) ? 1 : op.size(); // symbols take one token per character
+    }
+
+    // Reads the verbatim tokens of cimple.unsafe.inline(...) up to the matching parenthesis.
+    std::vector<std::string> rawUntilClose() {
+        std::vector<std::string> raw;
+        int depth = 1;
+        while (!done()) {
+            if (at("("))
+                depth++;
+            if (at(")"))
+                depth--;
+            if (depth == 0)
+                break;
+            if (peek()[0] == '#')
+                throw std::runtime_error("For added safety, you cannot also not use preprocessor directives when inlining.");
+            raw.push_back(tokens[pos++]);
+        }
+        expect(")");
+        return raw;
+    }
+    bool atUnsafe(std::string_view what) const {
+        return at("cimple") && at(".", 1) && at("unsafe", 2) && at(".", 3) && at(what, 4) && at("(", 5);
+    }
+
+    Decl parseDecl() {
+        Decl decl;
+        decl.position = pos;
+        if (at("func") || at("gen") || (at("comptime") && at("func", 1))) {
+            decl.kind = Decl::Kind::Func;
+            decl.func = parseFunc(true, "");
+        }
+        else if (at("struct")) {
+            decl.kind = Decl::Kind::Struct;
+            ++pos;
+            if (pos + 1 >= tokens.size())
+                throw std::runtime_error("`struct` definition is incomplete");
+            if (!at("{", 1))
+                throw std::runtime_error("Invalid `struct` definition");
+            decl.name = name();
+            expect("{");
+            while (!at("}")) {
+                if (done())
+                    throw std::runtime_error("`struct` definition is incomplete");
+                if (at(";")) {
+                    ++pos;
+                    continue;
+                }
+                decl.members.push_back(parseMember(decl.name));
+            }
+            expect("}");
+            if (at(";"))
+                ++pos;
+        }
+        else if (at("type")) {
+            decl.kind = Decl::Kind::Concept;
+            ++pos;
+            if (pos + 1 >= tokens.size())
+                throw std::runtime_error("`type` definition is incomplete");
+            if (!at("{", 1))
+                throw std::runtime_error("Invalid `type` definition");
+            decl.name = name();
+            expect("{");
+            while (!at("}")) {
+                if (done())
+                    throw std::runtime_error("`type` definition is incomplete");
+                Requirement requirement;
+                if (at("exists")) {
+                    ++pos;
+                    expect("[");
+                    requirement.type = parseType();
+                    expect("]");
+                }
+                requirement.value = parseExpr();
+                if (!at(";"))
+                    throw std::runtime_error("Never terminated the `exists` statement with `;`.");
+                ++pos;
+                decl.requirements.push_back(std::move(requirement));
+            }
+            expect("}");
+            if (at(";"))
+                ++pos;
+        }
+        else if (at("var") && at("=", 2) && at("cimple", 3) && at(".", 4) && at("import", 5)) {
+            decl.kind = Decl::Kind::Import;
+            ++pos;
+            decl.name = name();
+            pos += 4;
+            expect("(");
+            if (peek()[0] != '"')
+                fail("Expected the path of the imported module");
+            decl.path = tokens[pos++];
+            decl.path = decl.path.substr(1, decl.path.find_last_of('"') - 1);
+            expect(")");
+            expect(";");
+        }
+        else if (atUnsafe("include")) {
+            decl.kind = Decl::Kind::Include;
+            pos += 6;
+            decl.path = peek();
+            ++pos;
+            if (!at(")") || !at(";", 1))
+                throw std::runtime_error("Invalid unsafe include syntax.");
+            pos += 2;
+        }
+        else if (at("bench") && peek(1)[0] == '"' && at("{", 2)) {
+            decl.kind = Decl::Kind::Bench;
+            decl.name = peek(1);
+            pos += 2;
+            decl.func = std::make_unique<Func>();
+            decl.func->position = decl.position;
+            decl.func->body = parseBlock();
+        }
+        else if (at("cimple") && at(".", 1) && at("get", 2) && at("(", 3)) {
+            decl.kind = Decl::Kind::Get;
+            if (peek(4)[0] != '"' || !at(",", 5) || peek(6)[0] != '"' || !at(")", 7) || !at(";", 8))
+                throw std::runtime_error("Invalid get syntax. Use cimple.get(\"path\", \"url\");");
+            decl.path = peek(4).substr(1, peek(4).size() - 2);
+            decl.url = peek(6).substr(1, peek(6).size() - 2);
+            pos += 9;
+        }
+        else {
+            decl.kind = Decl::Kind::Statement;
+            decl.statement = parseStmt();
+        }
+        return decl;
+    }
+
+    std::unique_ptr<Type> parseType() {
+        auto type = std::make_unique<Type>();
+        if (at("vector") || at("shared") || at("gen")) {
+            type->name = tokens[pos++];
+            if (!at("["))
+                throw std::runtime_error("Expected '[' after " + type->name);
+            ++pos;
+            type->element = parseType();
+            if (!at("]"))
+                throw std::runtime_error("Expected ']' after type parameters.");
+            ++pos;
+            return type;
+        }
+        if (at("map") && at("[", 1)) {
+            type->name = tokens[pos];
+            pos += 2;
+            type->element = parseType();
+            expect(",");
+            type->value = parseType();
+            if (!at("]"))
+                throw std::runtime_error("Expected ']' after type parameters.");
+            ++pos;
+            return type;
+        }
+        type->name = name();
+        while (at(".") && atName(1)) {
+            type->name += "." + peek(1);
+            pos += 2;
+        }
+        if (type->name == "unsigned" && (at("int") || at("long") || at("char")))
+            type->name += " " + tokens[pos++];
+        if (type->name == "long" && at("long"))
+            type->name += " " + tokens[pos++];
+        return type;
+    }
+
+    // Whether a type followed by a name starts at the current token, as in `double x = 0;`.
+    bool atDeclaration() {
+        if (!(at("vector") || at("shared") || at("gen") || atName()))
+            return false;
+        size_t start = pos;
+        bool declaration = false;
+        try {
+            parseType();
+            declaration = atName();
+        }
+        catch (const std::runtime_error&) {}
+        pos = start;
+        return declaration;
+    }
+
+    std::vector<Param> parseParams() {
+        std::vector<Param> params;
+        expect("(");
+        while (!at(")")) {
+            if (at("var"))
+                throw std::runtime_error("Explicit types are always expected as function arguments.");
+            Param param;
+            param.type = std::move(*parseType());
+            param.name = name();
+            params.push_back(std::move(param));
+            if (!at(")"))
+                expect(",");
+        }
+        expect(")");
+        return params;
+    }
+
+    std::unique_ptr<Func> parseFunc(bool declared, const std::string& owner) {
+        auto func = std::make_unique<Func>();
+        func->position = pos;
+        func->declared = declared;
+        if (at("comptime")) {
+            func->comptime = true;
+            ++pos;
+        }
+        if (at("gen")) {
+            func->generator = true;
+            func->declared = false;
+            ++pos;
+            expect("[");
+            func->result = parseType();
+            expect("]");
+            func->name = name();
+        }
+        else if (declared) {
+            if (pos + 4 >= tokens.size())
+                throw std::runtime_error("`fn` function declaration was not complete");
+            ++pos;
+            func->name = name();
+        }
+        else if (at(owner) && at("(", 1)) {
+            func->constructor = true;
+            func->name = tokens[pos++];
+        }
+        else {
+            func->result = parseType();
+            func->name = name();
+        }
+        func->params = parseParams();
+        func->body = parseBlock();
+        return func;
+    }
+
+    Member parseMember(const std::string& owner) {
+        Member member;
+        if (at("func") || at("gen") || (at(owner) && at("(", 1))) {
+            member.method = parseFunc(at("func"), owner);
+            return member;
+        }
+        size_t start = pos;
+        auto type = parseType();
+        std::string field = name();
+        if (at("(")) {
+            pos = start;
+            member.method = parseFunc(false, owner);
+            return member;
+        }
+        pos = start;
+        member.field = parseStmt();
+        if (member.field->kind != Stmt::Kind::Declare)
+            fail("Expected a field or method");
+        return member;
+    }
+
+    std::vector<StmtPtr> parseBlock() {
+        std::vector<StmtPtr> body;
+        expect("{");
+        while (!at("}")) {
+            if (done())
+                fail("Expected `}`");
+            body.push_back(parseStmt());
+        }
+        expect("}");
+        return body;
+    }
+
+    StmtPtr statement(Stmt::Kind kind, size_t position) {
+        auto stmt = std::make_unique<Stmt>();
+        stmt->kind = kind;
+        stmt->position = position;
+        return stmt;
+    }
+
+    StmtPtr parseStmt() {
+        size_t start = pos;
+        if (at(";")) {
+            ++pos;
+            return statement(Stmt::Kind::Empty, start);
+        }
+        if (at("{")) {
+            auto stmt = statement(Stmt::Kind::Block, start);
+            stmt->body = parseBlock();
+            return stmt;
+        }
+        if (at("if")) {
+            auto stmt = statement(Stmt::Kind::If, start);
+            ++pos;
+            expect("(");
+            stmt->value = parseExpr();
+            expect(")");
+            stmt->body.push_back(parseStmt());
+            if (at("else")) {
+                ++pos;
+                stmt->body.push_back(parseStmt());
+            }
+            return stmt;
+        }
+        if (at("while")) {
+            auto stmt = statement(Stmt::Kind::While, start);
+            ++pos;
+            expect("(");
+            stmt->value = parseExpr();
+            expect(")");
+            stmt->body.push_back(parseStmt());
+            return stmt;
+        }
+        if (at("do")) {
+            auto stmt = statement(Stmt::Kind::DoWhile, start);
+            ++pos;
+            stmt->body.push_back(parseStmt());
+            expect("while");
+            expect("(");
+            stmt->value = parseExpr();
+            expect(")");
+            expect(";");
+            return stmt;
+        }
+        if (at("for"))
+            return parseFor();
+        if (at("return")) {
+            auto stmt = statement(Stmt::Kind::Return, start);
+            ++pos;
+            if (!at(";"))
+                stmt->value = parseExpr();
+            expect(";");
+            return stmt;
+        }
+        if (at("break") || at("continue")) {
+            auto stmt = statement(at("break") ? Stmt::Kind::Break : Stmt::Kind::Continue, start);
+            ++pos;
+            expect(";");
+            return stmt;
+        }
+        if (at("try")) {
+            auto stmt = statement(Stmt::Kind::Try, start);
+            ++pos;
+            auto block = statement(Stmt::Kind::Block, pos);
+            block->body = parseBlock();
+            stmt->body.push_back(std::move(block));
+            while (at("catch")) {
+                ++pos;
+                expect("(");
+                stmt->catches.push_back(rawUntilClose());
+                auto handler = statement(Stmt::Kind::Block, pos);
+                handler->body = parseBlock();
+                stmt->body.push_back(std::move(handler));
+            }
+            return stmt;
+        }
+        if (at("yield")) {
+            auto stmt = statement(Stmt::Kind::Yield, start);
+            ++pos;
+            stmt->value = parseExpr();
+            expect(";");
+            return stmt;
+        }
+        if (at("unbind")) {
+            auto stmt = statement(Stmt::Kind::Unbind, start);
+            ++pos;
+            if (done())
+                throw std::runtime_error("Nothing to unbind");
+            stmt->value = parseExpr();
+            expect(";");
+            return stmt;
+        }
+        if (atUnsafe("inline") && !at(".", 6)) {
+            auto stmt = statement(Stmt::Kind::Inline, start);
+            pos += 6;
+            stmt->raw = rawUntilClose();
+            if (at(";"))
+                ++pos;
+            return stmt;
+        }
+        StmtPtr stmt = parseSimple();
+        expect(";");
+        return stmt;
+    }
+
+    // Declarations and expressions, which may also appear in the header of a for loop.
+    StmtPtr parseSimple() {
+        size_t start = pos;
+        if (at("comptime") && at("var", 1)) {
+            ++pos;
+            StmtPtr stmt = parseSimple();
+            if (!stmt->value)
+                fail("A `comptime var` needs a value");
+            stmt->comptime = true;
+            return stmt;
+        }
+        if (at("var")) {
+            auto stmt = statement(Stmt::Kind::Var, start);
+            ++pos;
+            stmt->name = name();
+            if (at("=")) {
+                ++pos;
+                stmt->value = parseExpr();
+            }
+            return stmt;
+        }
+        if (atDeclaration()) {
+            auto stmt = statement(Stmt::Kind::Declare, start);
+            stmt->type = parseType();
+            stmt->name = name();
+            if (at("=")) {
+                ++pos;
+                stmt->value = parseExpr();
+            }
+            else if (at("(")) {
+                ++pos;
+                stmt->constructed = true;
+                stmt->arguments = parseArguments(")");
+            }
+            return stmt;
+        }
+        auto stmt = statement(Stmt::Kind::Expr, start);
+        stmt->value = parseExpr();
+        return stmt;
+    }
+
+    StmtPtr parseFor() {
+        size_t start = pos;
+        ++pos;
+        expect("(");
+        if (at("var") && (at("in", 2) || at("[", 1))) {
+            auto stmt = statement(Stmt::Kind::ForIn, start);
+            ++pos;
+            if (at("[")) {
+                stmt->binding = true;
+                ++pos;
+                while (!at("]")) {
+                    stmt->names.push_back(name());
+                    if (!at("]"))
+                        expect(",");
+                }
+                ++pos;
+            }
+            else
+                stmt->names.push_back(name());
+            expect("in");
+            stmt->value = parseExpr();
+            expect(")");
+            stmt->body.push_back(parseStmt());
+            return stmt;
+        }
+        auto stmt = statement(Stmt::Kind::For, start);
+        if (at(";"))
+            stmt->init = statement(Stmt::Kind::Empty, pos);
+        else
+            stmt->init = parseSimple();
+        expect(";");
+        if (!at(";"))
+            stmt->value = parseExpr();
+        expect(";");
+        while (!at(")")) {
+            stmt->steps.push_back(parseExpr());
+            if (!at(")"))
+                expect(",");
+        }
+        expect(")");
+        stmt->body.push_back(parseStmt());
+        return stmt;
+    }
+
+    std::vector<ExprPtr> parseArguments(std::string_view close) {
+        std::vector<ExprPtr> arguments;
+        while (!at(close)) {
+            std::string op = peekOperator();
+            size_t width = std::isalpha(static_cast<unsigned char>(op[0])) ? 1 : op.size();
+            if (close == ")" && precedence(op) && (at(",", width) || at(close, width))) {
+                arguments.push_back(expression(Expr::Kind::Operator, pos, op));
+                skipOperator(op);
+            }
+            else
+                arguments.push_back(parseExpr());
+            if (!at(close))
+                expect(",");
+        }
+        expect(close);
+        return arguments;
+    }
+
+    ExprPtr expression(Expr::Kind kind, size_t position, const std::string& text = "") {
+        auto expr = std::make_unique<Expr>();
+        expr->kind = kind;
+        expr->position = position;
+        expr->text = text;
+        return expr;
+    }
+
+    ExprPtr parseExpr() {
+        size_t start = pos;
+        ExprPtr target = parseBinary(0);
+        static const std::unordered_set<std::string> assignments = {"=", "+=", "-=", "*=", "/=", "%=", "|=", "^=", "<<=", ">>="};
+        std::string op = peekOperator();
+        if (!assignments.count(op) || (op == "=" && at("=", 1)))
+            return target;
+        skipOperator(op);
+        auto assign = expression(Expr::Kind::Assign, start, op);
+        assign->items.push_back(std::move(target));
+        assign->items.push_back(parseExpr());
+        return assign;
+    }
+
+    static int precedence(const std::string& op) {
+        if (op == "||" || op == "or") return 1;
+        if (op == "&&" || op == "and") return 2;
+        if (op == "|") return 3;
+        if (op == "^") return 4;
+        if (op == "==" || op == "!=") return 5;
+        if (op == "<" || op == ">" || op == "<=" || op == ">=") return 6;
+        if (op == "<<" || op == ">>") return 7;
+        if (op == "+" || op == "-") return 8;
+        if (op == "*" || op == "/" || op == "%") return 9;
+        return 0;
+    }
+
+    ExprPtr parseBinary(int minimum) {
+        size_t start = pos;
+        ExprPtr left = parseUnary();
+        while (true) {
+            std::string op = peekOperator();
+            int level = precedence(op);
+            if (level <= minimum)
+                return left;
+            skipOperator(op);
+            auto binary = expression(Expr::Kind::Binary, start, op);
+            binary->items.push_back(std::move(left));
+            binary->items.push_back(parseBinary(level));
+            left = std::move(binary);
+        }
+    }
+
+    ExprPtr parseUnary() {
+        size_t start = pos;
+        std::string op = peekOperator();
+        if (op == "-" || op == "+" || op == "!" || op == "~" || op == "++" || op == "--" || op == "not") {
+            skipOperator(op);
+            auto unary = expression(Expr::Kind::Unary, start, op);
+            unary->items.push_back(parseUnary());
+            return unary;
+        }
+        return parsePostfix();
+    }
+
+    ExprPtr parsePostfix() {
+        size_t start = pos;
+        ExprPtr expr = parsePrimary();
+        while (true) {
+            if (at("(")) {
+                ++pos;
+                auto call = expression(Expr::Kind::Call, start);
+                call->items.push_back(std::move(expr));
+                for (auto& argument : parseArguments(")"))
+                    call->items.push_back(std::move(argument));
+                expr = std::move(call);
+            }
+            else if (at("[")) {
+                ++pos;
+                auto index = expression(Expr::Kind::Index, start);
+                index->items.push_back(std::move(expr));
+                index->items.push_back(parseExpr());
+                expect("]");
+                expr = std::move(index);
+            }
+            else if (at(".")) {
+                ++pos;
+                if (!isIdentifier(peek()))
+                    fail("Expected a member name after `.`");
+                if (at("unbind"))
+                    fail("Use `unbind name;` to unbind");
+                auto member = expression(Expr::Kind::Member, start, tokens[pos++]);
+                member->items.push_back(std::move(expr));
+                expr = std::move(member);
+            }
+            else if (peekOperator() == "++" || peekOperator() == "--") {
+                auto postfix = expression(Expr::Kind::Postfix, start, peekOperator());
+                skipOperator(postfix->text);
+                postfix->items.push_back(std::move(expr));
+                expr = std::move(postfix);
+            }
+            else
+                return expr;
+        }
+    }
+
+    ExprPtr parsePrimary() {
+        size_t start = pos;
+        if (done())
+            fail("Expected an expression");
+        const std::string& token = peek();
+        if (token[0] == '"') {
+            ++pos;
+            return expression(Expr::Kind::String, start, token);
+        }
+        if (token == "'") {
+            std::string text = "'";
+            ++pos;
+            while (!done() && !at("'"))
+                text += tokens[pos++];
+            if (text == "'")
+                text += " "; // the tokenizer drops whitespace, which only leaves room for a space
+            expect("'");
+            return expression(Expr::Kind::Char, start, text + "'");
+        }
+        if (std::isdigit(static_cast<unsigned char>(token[0]))) {
+            std::string text = tokens[pos++];
+            if (at(".") && !done() && pos + 1 < tokens.size() && std::isdigit(static_cast<unsigned char>(peek(1)[0]))) {
+                text += "." + peek(1);
+                pos += 2;
+            }
+            else if (at(".") && !atName(1)) {
+                text += ".";
+                ++pos;
+            }
+            if ((text.back() == 'e' || text.back() == 'E') && (at("-") || at("+")) && pos + 1 < tokens.size() && std::isdigit(static_cast<unsigned char>(peek(1)[0]))) {
+                text += peek() + peek(1);
+                pos += 2;
+            }
+            return expression(Expr::Kind::Number, start, text);
+        }
+        if (at("(")) {
+            ++pos;
+            auto paren = expression(Expr::Kind::Paren, start);
+            paren->items.push_back(parseExpr());
+            expect(")");
+            return paren;
+        }
+        if (at("{")) {
+            ++pos;
+            auto list = expression(Expr::Kind::List, start);
+            list->items = parseArguments("}");
+            return list;
+        }
+        if (at("vector") || at("shared") || (at("map") && at("[", 1))) {
+            auto handler = expression(Expr::Kind::Handler, start);
+            handler->type = parseType();
+            return handler;
+        }
+        if (atUnsafe("inline")) {
+            pos += 6;
+            auto inlined = expression(Expr::Kind::Inline, start);
+            inlined->raw = rawUntilClose();
+            return inlined;
+        }
+        if (at("self") && !at(".", 1))
+            throw std::runtime_error("`self` must be followed by `.` and cannot be returned");
+        if (isIdentifier(token) && (!keywords().count(token) || token == "in")) {
+            if (token == "in")
+                fail("Unexpected `in`");
+            check(token);
+            ++pos;
+            return expression(Expr::Kind::Name, start, token);
+        }
+        check(token);
+        peekOperator();
+        fail("Unexpected `" + token + "`");
+    }
+};
+
+
+#endif // CIMPLE_CPARSE_H
@@ -0,0 +1,108 @@
+#ifndef CIMPLE_CSCAN_H
+#define CIMPLE_CSCAN_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Byte classes of the tokenizer, as std::isspace and std::ispunct give them in the C locale, except that `_` belongs
+// to words. Bytes outside ASCII are parts of words, so UTF-8 names stay whole.
+enum class ByteClass : uint8_t { Word, Space, Punct };
+
+inline constexpr std::array<ByteClass, 256> byteClasses = [] {
+    std::array<ByteClass, 256> classes{};
+    for (int c = 0; c < 256; ++c) {
+        bool alnum = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+            classes[c] = ByteClass::Space;
+        else if (c > ' ' && c < 0x7f && !alnum && c != '_')
+            classes[c] = ByteClass::Punct;
+        else
+            classes[c] = ByteClass::Word;
+    }
+    return classes;
+}();
+
+inline ByteClass byteClass(char c) { return byteClasses[static_cast<unsigned char>(c)]; }
+
+#if defined(__SSE2__)
+// Masks with one bit per byte of the 32 bytes at `at`, which are classified with signed comparisons
+// so that bytes outside ASCII, being negative, fall in no range.
+struct ByteMasks {
+    uint32_t space;
+    uint32_t boundary; // space or punctuation
+
+    explicit ByteMasks(const char* at) {
+        space = 0;
+        boundary = 0;
+        for (int half = 0; half < 2; ++half) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(at + half * 16));
+            auto in = [&](char low, char high) {
+                return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(high + 1)));
+            };
+            __m128i spaces = _mm_or_si128(in('\t', '\r'), _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+            __m128i word = _mm_or_si128(_mm_or_si128(in('0', '9'), in('A', 'Z')), _mm_or_si128(in('a', 'z'), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_'))));
+            __m128i punct = _mm_andnot_si128(word, in(' ' + 1, 0x7e));
+            space |= static_cast<uint32_t>(_mm_movemask_epi8(spaces)) << (half * 16);
+            boundary |= static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(spaces, punct))) << (half * 16);
+        }
+    }
+};
+#endif
+
+// End of the word that starts at `i`, scanning 32 bytes at a time and the tail byte by byte
+inline size_t wordEnd(const char* data, size_t i, size_t size) {
+#if defined(__SSE2__)
+    for (; i + 32 <= size; i += 32) {
+        uint32_t boundary = ByteMasks(data + i).boundary;
+        if (boundary)
+            return i + __builtin_ctz(boundary);
+    }
+#endif
+    while (i < size && byteClass(data[i]) == ByteClass::Word)
+        ++i;
+    return i;
+}
+
+// End of the whitespace that starts at `i`, such as indentation
+inline size_t spaceEnd(const char* data, size_t i, size_t size) {
+#if defined(__SSE2__)
+    for (; i + 32 <= size; i += 32) {
+        uint32_t other = ~ByteMasks(data + i).space;
+        if (other)
+            return i + __builtin_ctz(other);
+    }
+#endif
+    while (i < size && byteClass(data[i]) == ByteClass::Space)
+        ++i;
+    return i;
+}
+
+// Whether the byte at `i` follows an odd number of backslashes, none of them before `begin`,
+// so that the quote in "a\"b" is escaped but the one in "a\\" is not
+inline bool escaped(const char* data, size_t i, size_t begin = 0) {
+    size_t backslashes = 0;
+    while (i > begin + backslashes && data[i - backslashes - 1] == '\\')
+        ++backslashes;
+    return backslashes % 2 == 1;
+}
+
+// End of the string literal whose opening quote is at `i`, past its closing quote, or `size` if it is not closed
+inline size_t stringEnd(const char* data, size_t i, size_t size) {
+    for (size_t at = i + 1; at < size; ++at) {
+        const void* quote = std::memchr(data + at, '"', size - at);
+        if (!quote)
+            break;
+        at = static_cast<const char*>(quote) - data;
+        if (!escaped(data, at, i + 1))
+            return at + 1;
+    }
+    return size;
+}
+
+
+#endif // CIMPLE_CSCAN_H
@@ -0,0 +1,300 @@
+#ifndef CIMPLE_CSTORE_H
+#define CIMPLE_CSTORE_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <cerrno>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "cget.h"
+
+extern char** environ;
+
+// Content hash of fetched modules (SHA-256), used to name them in the package store and to pin them in the lockfile.
+inline std::string content_hash(const std::string& data) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotate = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    std::string message = data;
+    uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+    message += static_cast<char>(0x80);
+    while (message.size() % 64 != 56)
+        message += static_cast<char>(0);
+    for (int i = 7; i >= 0; --i)
+        message += static_cast<char>(bits >> (i * 8));
+
+    for (size_t block = 0; block < message.size(); block += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t(uint8_t(message[block + i * 4])) << 24) | (uint32_t(uint8_t(message[block + i * 4 + 1])) << 16)
+                 | (uint32_t(uint8_t(message[block + i * 4 + 2])) << 8) | uint32_t(uint8_t(message[block + i * 4 + 3]));
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], x = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = x + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            x = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += x;
+    }
+
+    static const char* digits = "0123456789abcdef";
+    std::string hex;
+    for (uint32_t word : h)
+        for (int i = 28; i >= 0; i -= 4)
+            hex += digits[(word >> i) & 15];
+    return hex;
+}
+
+inline bool read_file(const std::string& path, std::string& content) {
+    std::ifstream infile(path, std::ios::binary);
+    if (!infile.is_open())
+        return false;
+    std::stringstream buffer;
+    buffer << infile.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+inline bool write_file(const std::string& path, const std::string& content) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream outfile(temporary, std::ios::binary);
+        if (!outfile.is_open())
+            return false;
+        outfile << content;
+        if (!outfile.good())
+            return false;
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+inline void make_directories(const std::string& path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos)
+            break;
+    }
+}
+
+// Removes a directory with everything in it
+inline void remove_directory(const std::string& path) {
+    if (DIR* directory = opendir(path.c_str())) {
+        while (dirent* entry = readdir(directory)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+            struct stat info;
+            std::string child = path + "/" + name;
+            if (lstat(child.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+                remove_directory(child);
+            else
+                unlink(child.c_str());
+        }
+        closedir(directory);
+    }
+    rmdir(path.c_str());
+}
+
+// Fetches a url that the built-in client does not speak with curl. It is started without a shell and the url comes
+// after `--`, so that no url can run commands or pass options.
+inline bool curl_file(const std::string& url, const std::string& path) {
+    std::vector<std::string> args = {"curl", "-fsSL", "--retry", "2", "-o", path, "--", url};
+    std::vector<char*> argv;
+    for (std::string& arg : args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0)
+        return false;
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Modules fetched by `cimple.get(path, url)` live in a content-addressed store under ~/.cache/cimple
+// and are pinned by url and hash in the project's cimple.lock. A dependency is only fetched when the
+// store lacks its pinned hash, so builds run offline once every dependency has been fetched.
+class PackageStore {
+public:
+    struct Pin {
+        std::string url;
+        std::string hash;
+    };
+
+    PackageStore() {
+        const char* custom = std::getenv("CIMPLE_CACHE");
+        const char* xdg = std::getenv("XDG_CACHE_HOME");
+        const char* home = std::getenv("HOME");
+        if (custom && *custom)
+            root = custom;
+        else if (xdg && *xdg)
+            root = std::string(xdg) + "/cimple";
+        else
+            root = std::string(home && *home ? home : "/tmp") + "/.cache/cimple";
+    }
+
+    // Starts a build against the pins of `lockfile`.
+    void open(const std::string& lockfile = "cimple.lock") {
+        this->lockfile = lockfile;
+        pins.clear();
+        fetched.clear();
+        std::ifstream infile(lockfile);
+        std::string line;
+        while (std::getline(infile, line)) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::istringstream fields(line);
+            std::string path;
+            Pin pin;
+            if (fields >> path >> pin.url >> pin.hash)
+                pins[path] = pin;
+        }
+    }
+
+    std::string blob(const std::string& hash) const { return root + "/sha256/" + hash; }
+    const std::string& directory() const { return root; }
+
+    // Fetches every (path, url) dependency that the store lacks, concurrently and at most once per url.
+    bool prefetch(const std::vector<std::pair<std::string, std::string>>& dependencies) {
+        std::vector<std::string> urls;
+        for (const auto& [path, url] : dependencies) {
+            auto pin = pins.find(path);
+            bool pinned = pin != pins.end() && pin->second.url == url;
+            if (pinned && access(blob(pin->second.hash).c_str(), R_OK) == 0)
+                continue;
+            if (fetched.count(url))
+                continue;
+            fetched[url] = "";
+            urls.push_back(url);
+        }
+        if (urls.empty())
+            return true;
+        make_directories(root + "/sha256");
+        make_directories(root + "/partial");
+
+        std::vector<Download> http;
+        std::vector<std::string> other;
+        for (const auto& url : urls) {
+            std::cout << "  Fetching: " << url << std::endl;
+            if (url.substr(0, 7) == "http://")
+                http.push_back({url, partial(url)});
+            else
+                other.push_back(url);
+        }
+        std::vector<std::thread> threads;
+        std::vector<char> succeeded(other.size(), false);
+        // the built-in fetcher speaks plain http only, so other schemes go through curl, as many at once as http downloads
+        std::atomic<size_t> next(0);
+        for (size_t i = 0; i < std::min(parallel, other.size()); ++i)
+            threads.emplace_back([&]() {
+                for (size_t i = next++; i < other.size(); i = next++)
+                    succeeded[i] = curl_file(other[i], partial(other[i]));
+            });
+        std::vector<bool> downloaded = download_files(http, parallel);
+        for (auto& thread : threads)
+            thread.join();
+
+        bool success = true;
+        for (size_t i = 0; i < http.size(); ++i)
+            success = store(http[i].url, downloaded[i]) && success;
+        for (size_t i = 0; i < other.size(); ++i)
+            success = store(other[i], succeeded[i]) && success;
+        return success;
+    }
+
+    // Places the pinned content of `path` in the project, fetching it first if needed. Returns the content hash.
+    std::string require(const std::string& path, const std::string& url) {
+        auto pin = pins.find(path);
+        bool pinned = pin != pins.end() && pin->second.url == url;
+        if (!pinned || access(blob(pin->second.hash).c_str(), R_OK) != 0)
+            prefetch({{path, url}});
+        std::string hash = fetched[url];
+        if (pinned && !hash.empty() && hash != pin->second.hash)
+            throw std::runtime_error("Content of " + url + " does not match its hash in " + lockfile + ". Remove the entry of " + path + " from " + lockfile + " to accept the new content.");
+        if (pinned)
+            hash = pin->second.hash;
+        else if (hash.empty())
+            throw std::runtime_error("Could not fetch " + url);
+        else {
+            pins[path] = Pin{url, hash};
+            save();
+        }
+
+        std::string content;
+        std::string current;
+        if (!read_file(blob(hash), content))
+            throw std::runtime_error("Could not fetch " + url);
+        if (!read_file(path, current) || current != content) {
+            size_t slash = path.find_last_of('/');
+            if (slash != std::string::npos)
+                make_directories(path.substr(0, slash));
+            if (!write_file(path, content))
+                throw std::runtime_error("Could not write " + path);
+        }
+        return hash;
+    }
+
+private:
+    static constexpr size_t parallel = 8; // downloads at once, for each of http and curl
+    std::string lockfile;
+    std::string root;
+    std::map<std::string, Pin> pins;
+    std::unordered_map<std::string, std::string> fetched; // url to content hash, empty while unknown or failed
+
+    std::string partial(const std::string& url) const { return root + "/partial/" + content_hash(url); }
+
+    bool store(const std::string& url, bool downloaded) {
+        std::string content;
+        if (!downloaded || !read_file(partial(url), content)) {
+            std::cerr << "Failed to fetch " << url << "\n";
+            return false;
+        }
+        std::string hash = content_hash(content);
+        if (std::rename(partial(url).c_str(), blob(hash).c_str()) != 0) {
+            std::cerr << "Could not add " << url << " to the package store at " << root << "\n";
+            return false;
+        }
+        fetched[url] = hash;
+        return true;
+    }
+
+    void save() const {
+        std::string content = "# cimple.lock: path url sha256\n";
+        for (const auto& [path, pin] : pins)
+            content += path + " " + pin.url + " " + pin.hash + "\n";
+        if (!write_file(lockfile, content))
+            std::cerr << "Could not write " << lockfile << "\n";
+    }
+};
+
+
+#endif // CIMPLE_CSTORE_H
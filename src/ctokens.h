@@ -0,0 +1,131 @@
+#ifndef CIMPLE_CTOKENS_H
+#define CIMPLE_CTOKENS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cparse.h"
+#include "cstore.h"
+
+// Token streams of modules saved on disk by the content hash of their source, so that builds in new processes
+// load them instead of lexing. A file holds a header, the offsets of its distinct token texts, one record of
+// (text, line, column) per token, and the texts themselves, all as native 32-bit words that are read through mmap.
+// Bump `version` whenever the tokenizer changes what it produces.
+class TokenCache {
+public:
+    static constexpr char magic[8] = {'c', 'i', 'm', 'p', 'l', 'e', 't', 'k'};
+    static constexpr uint32_t version = 2;
+
+    explicit TokenCache(const std::string& directory) : directory(directory) {}
+
+    std::string path(const std::string& hash) const { return directory + "/" + hash; }
+
+    bool load(const std::string& hash, std::vector<std::string>& tokens, std::vector<Location>& locations) const {
+        int file = open(path(hash).c_str(), O_RDONLY);
+        if (file < 0)
+            return false;
+        struct stat info;
+        if (fstat(file, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+            close(file);
+            return false;
+        }
+        size_t size = info.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+        if (mapped == MAP_FAILED)
+            return false;
+        bool loaded = read(static_cast<const char*>(mapped), size, tokens, locations);
+        munmap(mapped, size);
+        return loaded;
+    }
+
+    void save(const std::string& hash, const std::vector<std::string>& tokens, const std::vector<Location>& locations) const {
+        std::unordered_map<std::string_view, uint32_t> ids;
+        std::vector<uint32_t> offsets = {0};
+        std::vector<uint32_t> records;
+        std::string text;
+        records.reserve(tokens.size() * 3);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            auto [id, added] = ids.try_emplace(tokens[i], static_cast<uint32_t>(offsets.size() - 1));
+            if (added) {
+                text += tokens[i];
+                offsets.push_back(static_cast<uint32_t>(text.size()));
+            }
+            records.push_back(id->second);
+            records.push_back(i < locations.size() ? locations[i].line : 0);
+            records.push_back(i < locations.size() ? locations[i].column : 0);
+        }
+        Header header;
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.strings = static_cast<uint32_t>(offsets.size() - 1);
+        header.tokens = static_cast<uint32_t>(tokens.size());
+        header.text = static_cast<uint32_t>(text.size());
+
+        std::string content(reinterpret_cast<const char*>(&header), sizeof(header));
+        content.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint32_t));
+        content.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(uint32_t));
+        content += text;
+        make_directories(directory);
+        write_file(path(hash), content); // a cache that cannot be written only costs the next build its lexing
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t strings;
+        uint32_t tokens;
+        uint32_t text;
+    };
+
+    std::string directory;
+
+    static bool read(const char* data, size_t size, std::vector<std::string>& tokens, std::vector<Location>& locations) {
+        Header header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version)
+            return false;
+        size_t words = (static_cast<size_t>(header.strings) + 1) + static_cast<size_t>(header.tokens) * 3;
+        if (size != sizeof(header) + words * sizeof(uint32_t) + header.text)
+            return false;
+        const char* offsets = data + sizeof(header);
+        const char* records = offsets + (header.strings + 1) * sizeof(uint32_t);
+        const char* text = records + static_cast<size_t>(header.tokens) * 3 * sizeof(uint32_t);
+        auto word = [](const char* at, size_t index) {
+            uint32_t value;
+            std::memcpy(&value, at + index * sizeof(uint32_t), sizeof(value));
+            return value;
+        };
+
+        std::vector<std::string_view> strings(header.strings);
+        for (uint32_t i = 0; i < header.strings; ++i) {
+            uint32_t begin = word(offsets, i), end = word(offsets, i + 1);
+            if (begin > end || end > header.text)
+                return false;
+            strings[i] = std::string_view(text + begin, end - begin);
+        }
+        tokens.clear();
+        locations.clear();
+        tokens.reserve(header.tokens);
+        locations.reserve(header.tokens);
+        for (uint32_t i = 0; i < header.tokens; ++i) {
+            uint32_t id = word(records, i * 3);
+            if (id >= header.strings)
+                return false;
+            tokens.emplace_back(strings[id]);
+            locations.push_back(Location{word(records, i * 3 + 1), word(records, i * 3 + 2)});
+        }
+        return true;
+    }
+};
+
+
+#endif // CIMPLE_CTOKENS_H
@@ -0,0 +1,199 @@
+#ifndef CIMPLE_IO_H
+#define CIMPLE_IO_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cimple::io {
+
+inline std::string_view trim(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+}
+
+inline double number(std::string_view text) {
+    text = trim(text);
+    if (!text.empty() && text.front() == '+') text.remove_prefix(1);
+    double value = 0;
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != std::errc() || result.ptr != text.data() + text.size())
+        throw std::invalid_argument("Cannot parse `" + std::string(text) + "` as a number");
+    return value;
+}
+
+inline long long integer(std::string_view text) {
+    text = trim(text);
+    if (!text.empty() && text.front() == '+') text.remove_prefix(1);
+    long long value = 0;
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != std::errc() || result.ptr != text.data() + text.size())
+        throw std::invalid_argument("Cannot parse `" + std::string(text) + "` as an integer");
+    return value;
+}
+
+// A line or field that points into the reader's buffer. It is valid until the reader moves to the next line.
+struct View {
+    std::string_view text;
+    const View* operator->() const {return this;} // optimized away by -O2
+    size_t size() const { return text.size(); }
+    bool empty() const { return text.empty(); }
+    double number() const { return io::number(text); }
+    long long integer() const { return io::integer(text); }
+    operator std::string_view() const { return text; }
+    friend bool operator==(const View& view, std::string_view other) { return view.text == other; }
+    friend std::ostream& operator<<(std::ostream& stream, const View& view) { return stream << view.text; }
+};
+
+// A CSV row whose fields point into the reader's buffer, again valid until the next row is read.
+class Row {
+private:
+    const std::vector<View>* fields;
+public:
+    explicit Row(const std::vector<View>* fields) : fields(fields) {}
+    const Row* operator->() const {return this;} // optimized away by -O2
+    void lock() const {}
+    void unlock() const {}
+    auto begin() const { return fields->begin(); }
+    auto end() const { return fields->end(); }
+    size_t size() const { return fields->size(); }
+    const View& operator[](size_t index) const {
+        if (index >= fields->size()) throw std::out_of_range("Field "+std::to_string(index)+" casted from negative int or out of bounds in row with "+std::to_string(fields->size())+" fields");
+        return (*fields)[index];
+    }
+};
+
+// Input iterator that pulls items from a reader until it runs dry.
+template <typename Reader, typename Item>
+class Cursor {
+private:
+    Reader* reader;
+    Item item;
+    bool done;
+public:
+    Cursor(Reader* reader) : reader(reader), item(reader->first()), done(!reader->next(item)) {}
+    const Item& operator*() const { return item; }
+    Cursor& operator++() { done = !reader->next(item); return *this; }
+    bool operator!=(std::default_sentinel_t) const { return !done; }
+};
+
+// Reads a file in large chunks with read(2) and splits it into lines without copying them.
+class Lines {
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t start = 0;
+    size_t stop = 0;
+    bool eof = false;
+    bool iterating = false;
+
+    void refill() {
+        if (start) {
+            std::memmove(buffer.data(), buffer.data() + start, stop - start);
+            stop -= start;
+            start = 0;
+        }
+        if (stop == buffer.size())
+            buffer.resize(buffer.size() * 2); // a single line is longer than the buffer
+        while (true) {
+            ssize_t count = ::read(fd, buffer.data() + stop, buffer.size() - stop);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) throw std::runtime_error("Failed to read file: " + std::string(std::strerror(errno)));
+            if (count == 0) eof = true;
+            stop += count;
+            return;
+        }
+    }
+
+public:
+    static constexpr size_t chunk = 1 << 20;
+    explicit Lines(std::string_view path) : buffer(chunk) {
+        fd = path == "-" ? 0 : ::open(std::string(path).c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Could not open file: " + std::string(path));
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    ~Lines() { if (fd > 0) ::close(fd); }
+    Lines(const Lines&) = delete;
+    Lines(Lines&& other) noexcept : fd(other.fd), buffer(std::move(other.buffer)), start(other.start), stop(other.stop), eof(other.eof), iterating(other.iterating) {other.fd = -1;}
+    Lines* operator->() {return this;} // optimized away by -O2
+    void lock() { if (iterating) throw std::runtime_error("Cannot iterate through the same lines twice at once."); iterating = true; }
+    void unlock() { iterating = false; }
+    Cursor<Lines, View> begin() { return Cursor<Lines, View>(this); }
+    std::default_sentinel_t end() const { return {}; }
+    View first() const { return View{}; }
+
+    bool next(View& line) {
+        while (true) {
+            const char* from = buffer.data() + start;
+            const char* newline = static_cast<const char*>(std::memchr(from, '\n', stop - start));
+            if (newline || (eof && start < stop)) {
+                size_t length = newline ? newline - from : stop - start;
+                start += newline ? length + 1 : length;
+                if (length && from[length - 1] == '\r') --length;
+                line.text = std::string_view(from, length);
+                return true;
+            }
+            if (eof) return false;
+            refill();
+        }
+    }
+};
+
+// Splits each line of a file into fields on a separator, stripping the quotes of quoted fields.
+// Doubled quotes within quoted fields are kept as they are, and quoted fields cannot span lines.
+class Csv {
+private:
+    Lines lines;
+    char separator;
+    std::vector<View> fields;
+
+public:
+    Csv(std::string_view path, char separator) : lines(path), separator(separator) {}
+    Csv* operator->() {return this;} // optimized away by -O2
+    void lock() { lines.lock(); }
+    void unlock() { lines.unlock(); }
+    Cursor<Csv, Row> begin() { return Cursor<Csv, Row>(this); }
+    std::default_sentinel_t end() const { return {}; }
+    Row first() const { return Row(&fields); }
+
+    bool next(Row&) {
+        View line;
+        if (!lines.next(line)) return false;
+        fields.clear();
+        std::string_view rest = line.text;
+        while (true) {
+            size_t cut;
+            if (!rest.empty() && rest.front() == '"') {
+                size_t close = 1;
+                while ((close = rest.find('"', close)) != std::string_view::npos && close + 1 < rest.size() && rest[close + 1] == '"')
+                    close += 2;
+                if (close == std::string_view::npos) throw std::runtime_error("Unterminated quoted field in CSV line: " + std::string(line.text));
+                fields.push_back(View{rest.substr(1, close - 1)});
+                cut = rest.find(separator, close);
+            }
+            else {
+                cut = rest.find(separator);
+                fields.push_back(View{rest.substr(0, cut)});
+            }
+            if (cut == std::string_view::npos) return true;
+            rest.remove_prefix(cut + 1);
+        }
+    }
+};
+
+inline Lines lines(std::string_view path) { return Lines(path); }
+inline Csv csv(std::string_view path) { return Csv(path, ','); }
+inline Csv delimited(std::string_view path, char separator) { return Csv(path, separator); }
+
+}
+
+#endif // CIMPLE_IO_H
@@ -0,0 +1,174 @@
+// g++ tests/cget_test.cpp -o cget_test -O2 -std=c++20 -pthread && ./cget_test
+// Runs the module fetcher of src/cget.h against a stand-in HTTP server on a local port.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <arpa/inet.h>
+#include "../src/cget.h"
+
+// Serves `resources` over keep-alive connections, one at a time. Resources whose path starts with /chunked are sent with
+// chunked transfer encoding, and those whose path starts with /ignore-range are sent from their start as 206 whatever range
+// is asked for. Ranges that start past the end of a resource get 416 with its size.
+class StandInServer {
+public:
+    std::map<std::string, std::string> resources;
+    std::atomic<int> connections{0};
+    std::atomic<int> ranges{0}; // requests that asked for a range
+
+    StandInServer() {
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), length) != 0 || listen(listener, 8) != 0
+                || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+            throw std::runtime_error("Could not start the stand-in server");
+        port = ntohs(address.sin_port);
+        std::thread([this]() { serve(); }).detach();
+    }
+
+    std::string url(const std::string& path) const { return "http://127.0.0.1:" + std::to_string(port) + path; }
+
+private:
+    int listener;
+    int port;
+
+    void serve() {
+        while (true) {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+                return;
+            ++connections;
+            std::string received;
+            char chunk[4096];
+            while (true) {
+                size_t end;
+                while ((end = received.find("\r\n\r\n")) == std::string::npos) {
+                    ssize_t count = recv(client, chunk, sizeof(chunk), 0);
+                    if (count <= 0)
+                        break;
+                    received.append(chunk, count);
+                }
+                if (end == std::string::npos)
+                    break;
+                std::string request = received.substr(0, end);
+                received.erase(0, end + 4);
+                respond(client, request);
+            }
+            close(client);
+        }
+    }
+
+    void respond(int client, const std::string& request) {
+        std::string path = request.substr(4, request.find(' ', 4) - 4);
+        size_t offset = 0;
+        size_t range = request.find("Range: bytes=");
+        if (range != std::string::npos) {
+            ++ranges;
+            offset = std::strtoull(request.c_str() + range + 13, nullptr, 10);
+        }
+        auto found = resources.find(path);
+        std::string reply;
+        if (found == resources.end())
+            reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        else if (range != std::string::npos && path.rfind("/ignore-range", 0) == 0)
+            reply = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-" + std::to_string(found->second.size() - 1) + "/"
+                  + std::to_string(found->second.size()) + "\r\nContent-Length: " + std::to_string(found->second.size()) + "\r\n\r\n" + found->second;
+        else if (range != std::string::npos && offset >= found->second.size())
+            reply = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + std::to_string(found->second.size()) + "\r\nContent-Length: 0\r\n\r\n";
+        else if (path.rfind("/chunked", 0) == 0) {
+            reply = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+            for (size_t at = 0; at < found->second.size(); at += 7) {
+                std::string piece = found->second.substr(at, 7);
+                std::ostringstream size;
+                size << std::hex << piece.size();
+                reply += size.str() + "\r\n" + piece + "\r\n";
+            }
+            reply += "0\r\n\r\n";
+        }
+        else {
+            std::string body = found->second.substr(offset);
+            reply = range != std::string::npos
+                ? "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(offset) + "-" + std::to_string(found->second.size() - 1)
+                  + "/" + std::to_string(found->second.size()) + "\r\n"
+                : "HTTP/1.1 200 OK\r\n";
+            reply += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        }
+        for (size_t sent = 0; sent < reply.size();) {
+            ssize_t count = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+                return;
+            sent += count;
+        }
+    }
+};
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& name) {
+    std::cout << (condition ? "  passed: " : "  FAILED: ") << name << std::endl;
+    failures += !condition;
+}
+
+static std::string content(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+static void write(const std::string& path, const std::string& text) {
+    std::ofstream(path, std::ios::binary) << text;
+}
+
+int main() {
+    StandInServer server;
+    std::string directory = "/tmp/cget_test_" + std::to_string(getpid());
+    mkdir(directory.c_str(), 0755);
+    std::string text = "func main() {\n    print(\"fetched\");\n    return 0;\n}\n";
+    server.resources["/plain.cm"] = text;
+    server.resources["/other.cm"] = text + "// other\n";
+    server.resources["/chunked.cm"] = text;
+    server.resources["/resumed.cm"] = text;
+    server.resources["/complete.cm"] = text;
+    server.resources["/shrunk.cm"] = text;
+    server.resources["/ignore-range.cm"] = text;
+
+    std::vector<bool> done = download_files({{server.url("/plain.cm"), directory + "/plain.cm"},
+                                             {server.url("/other.cm"), directory + "/other.cm"},
+                                             {server.url("/chunked.cm"), directory + "/chunked.cm"}}, 1);
+    check(done[0] && content(directory + "/plain.cm") == text, "Content-Length body");
+    check(done[1] && content(directory + "/other.cm") == text + "// other\n", "second file on the same connection");
+    check(done[2] && content(directory + "/chunked.cm") == text, "chunked body");
+    check(server.connections == 1, "keep-alive connection reused for all files");
+
+    write(directory + "/resumed.cm.part", text.substr(0, 10));
+    done = download_files({{server.url("/resumed.cm"), directory + "/resumed.cm"}});
+    check(done[0] && content(directory + "/resumed.cm") == text && server.ranges == 1, "resumed from the partial file with 206");
+
+    write(directory + "/complete.cm.part", text);
+    done = download_files({{server.url("/complete.cm"), directory + "/complete.cm"}});
+    check(done[0] && content(directory + "/complete.cm") == text, "416 for a partial file that holds the whole resource");
+
+    write(directory + "/shrunk.cm.part", text + "// removed since\n");
+    done = download_files({{server.url("/shrunk.cm"), directory + "/shrunk.cm"}});
+    check(done[0] && content(directory + "/shrunk.cm") == text, "416 for a resource that shrank starts over");
+
+    write(directory + "/ignore-range.cm.part", text.substr(0, 10));
+    done = download_files({{server.url("/ignore-range.cm"), directory + "/ignore-range.cm"}});
+    check(done[0] && content(directory + "/ignore-range.cm") == text, "206 from another offset starts over");
+
+    done = download_files({{server.url("/missing.cm"), directory + "/missing.cm"}});
+    check(!done[0] && access((directory + "/missing.cm").c_str(), F_OK) != 0, "404 fails");
+
+    for (const char* name : {"plain", "other", "chunked", "resumed", "complete", "shrunk", "ignore-range"})
+        unlink((directory + "/" + name + ".cm").c_str());
+    rmdir(directory.c_str());
+    std::cout << (failures ? "Some fetcher tests failed." : "All fetcher tests passed.") << std::endl;
+    return failures != 0;
+}
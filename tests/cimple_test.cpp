@@ -0,0 +1,112 @@
+// g++ tests/cimple_test.cpp -o cimple_test -O2 -std=c++23 && ./cimple_test
+// Builds and runs small programs through the transpiler of src/cimple.cpp. Run it from the repository root, where the
+// standard modules are.
+#define main cimple_main
+#include "../src/cimple.cpp"
+#undef main
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& name) {
+    std::cout << (condition ? "  passed: " : "  FAILED: ") << name << std::endl;
+    failures += !condition;
+}
+
+// Builds `source` and returns what the program prints, or "" if it does not build.
+static std::string run(const std::string& directory, const std::string& name, const std::string& source) {
+    std::string filename = directory + "/" + name + ".cm";
+    write_file(filename, source);
+    std::string executable_name;
+    BuildOptions options;
+    int log = open((directory + "/" + name + ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool built = buildFile(filename, options, executable_name, log);
+    close(log);
+    std::string printed;
+    if (built) {
+        int output = open((directory + "/" + name + ".out").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        runProcess({executable_name}, output);
+        close(output);
+        read_file(directory + "/" + name + ".out", printed);
+    }
+    for (const char* suffix : {".cm", ".log", ".out", ""})
+        unlink((directory + "/" + name + suffix).c_str());
+    return printed;
+}
+
+static std::vector<std::string> tokens(const std::string& source) {
+    std::vector<Location> locations;
+    return tokenize(source, locations);
+}
+
+int main() {
+    // a comment right after a word ends it, so the word and the one on the next line are separate tokens
+    check(tokens("word//comment\nnext") == std::vector<std::string>{"word", "next"}, "comment after a word");
+    check(tokens("a / b // c\n/") == std::vector<std::string>{"a", "/", "b", "/"}, "division and comments");
+    check(tokens(R"(x = "a\"b" + "c:\\";)") == std::vector<std::string>{"x", "=", R"("a\"b")", "+", R"("c:\\")", ";"},
+          "escaped quotes and trailing backslashes in strings");
+    std::vector<Location> locations;
+    tokenize("first\n  second // third\nfourth", locations);
+    check(locations.size() == 3 && locations[1].line == 2 && locations[1].column == 3 && locations[2].line == 3
+          && locations[2].column == 1, "token locations across comments");
+
+    std::string directory = "/tmp/cimple_test_" + std::to_string(getpid());
+    mkdir(directory.c_str(), 0755);
+
+    // generators take their struct and vector parameters by non-const reference, so a function that passes its own
+    // parameter through to one must not receive it as const
+    check(run(directory, "generator", R"(
+gen[double] each(vector[double] v) {
+    for (var x in v)
+        yield x;
+}
+
+func total(vector[double] v) {
+    var sum = 0.0;
+    for (var x in each(v))
+        sum += x;
+    return sum;
+}
+
+func main() {
+    var v = vector[double]({1, 2.5});
+    print(total(v));
+    return 0;
+}
+)") == "3.5\n", "read-only parameter passed through to a generator");
+
+    // a user function named like a built-in one is analysed like any other function
+    check(run(directory, "shadowed", R"(
+func keep(vector[double] v) {
+    v.push(4);
+    return v.size();
+}
+
+func extend(vector[double] v) {
+    return keep(v);
+}
+
+func main() {
+    var v = vector[double]({1, 2.5});
+    print(extend(v));
+    print(v.size());
+    return 0;
+}
+)") == "3\n3\n", "user function that hides a built-in one");
+
+    // a signal in one thread writes what the other threads printed as well
+    check(run(directory, "signal", R"(
+cimple.unsafe.include(thread);
+
+func main() {
+    cimple.unsafe.inline(std::thread([] { ::cimple::out.write("7\n", 2); std::this_thread::sleep_for(std::chrono::seconds(2)); }).detach(););
+    cimple.unsafe.inline(std::this_thread::sleep_for(std::chrono::milliseconds(200)););
+    print(1);
+    cimple.unsafe.inline(std::raise(SIGTERM););
+    return 0;
+}
+)").size() == 4, "output of all threads flushed on a signal");
+
+    rmdir(directory.c_str());
+    std::cout << (failures ? "Some transpiler tests failed." : "All transpiler tests passed.") << std::endl;
+    return failures != 0;
+}